@@ -2,6 +2,9 @@
 //      KCrypt3 - 3rd iteration of the KCrypt algorithm.
 //      Written on Sunday, 20th of April 2025 by Kamila Szewczyk.
 // ---------------------------------------------------------------------------
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -10,7 +13,13 @@
 #include <stdarg.h>
 #include <ctype.h>
 #include <stdlib.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#include "kcrypt3.h"
+#ifndef KCRYPT3_LIBRARY
 #include "yarg.h"
+#endif
 
 // ---------------------------------------------------------------------------
 //      Galois field tables.
@@ -113,23 +122,341 @@ static void feistel1(gf L[32], gf R[32], gf k1[3][32], gf k2[64]) {
     memcpy(R, temp, 32);
   }
 }
-typedef struct { gf k1[32]; gf k2[64]; } block_key_t;
+// ---------------------------------------------------------------------------
+//      Precomputed-matrix kernel. The interpolation nodes of the Feistel
+//      function are always 0..63 and those of the key scheduler 0..31; the
+//      permutation only decides which value is attached to which node.
+//      Since interpolation followed by evaluation at fixed points is linear
+//      in the values, both functions reduce to products with constant
+//      matrices of Lagrange basis polynomials evaluated at the output
+//      points, with the permutation selecting the columns.
+//
+//      The same holds for wider blocks of 2h bytes, whose Feistel function
+//      interpolates 2h nodes at the h points from 255 down and whose key
+//      scheduler interpolates h nodes at the 3h points from 64 up. The
+//      points must not collide with the nodes, so h is at most 64. The
+//      functions below take the half-width and its tables; the 64-byte
+//      kernel instantiates them with h = 32.
+// ---------------------------------------------------------------------------
+static gf FWC[64][32], KVC[32][96], FWC128[128][64], KVC128[64][192];
+static gf MODT[128][256];
+// Evaluates the Lagrange basis polynomials of the nodes 0..n-1 at the m
+// points `p', which are not nodes: row `a' of `out' is the product of
+// (p - j) / (a - j) over the nodes j other than a.
+static void genmat_basis(int n, const gf * p, int m, gf * out) {
+  gf w[128], N[192];
+  for (int a = 0; a < n; a++) {
+    w[a] = 1;
+    for (int j = 0; j < n; j++) if (j != a) w[a] = gf_mul(w[a], a ^ j);
+  }
+  for (int t = 0; t < m; t++) {
+    N[t] = 1;
+    for (int j = 0; j < n; j++) N[t] = gf_mul(N[t], p[t] ^ j);
+  }
+  for (int a = 0; a < n; a++)
+    for (int t = 0; t < m; t++)
+      out[m * a + t] = gf_div(N[t], gf_mul(w[a], p[t] ^ a));
+}
+static void genmat_width(int h, gf * fwc, gf * kvc) {
+  gf p[192];
+  for (int i = 0; i < h; i++) p[i] = 255 - i;
+  genmat_basis(2 * h, p, h, fwc);
+  for (int t = 0; t < 3 * h; t++) p[t] = 64 * (t / h + 1) + t % h;
+  genmat_basis(h, p, 3 * h, kvc);
+}
+static void genmat(void) {
+  genmat_width(32, FWC[0], KVC[0]);
+  genmat_width(64, FWC128[0], KVC128[0]);
+  for (int i = 0; i < 128; i++)
+    for (int k = 0; k < 256; k++) MODT[i][k] = k % (i + 1);
+}
+static void permutation(gf * k, gf * x, int n) {
+  for (int i = 0; i < n; i++) x[i] = i;
+  for (int i = n - 1; i > 0; i--) {
+    int j = MODT[i][k[i]];
+    gf t = x[i]; x[i] = x[j]; x[j] = t;
+  }
+}
+// Inlined into each caller, so that the 64-byte kernel is compiled for its
+// constant half-width.
+#ifdef __GNUC__
+#define WIDTH_INLINE static inline __attribute__((always_inline))
+#else
+#define WIDTH_INLINE static inline
+#endif
+WIDTH_INLINE void feistelF_width(int h, const gf * fwc,
+    gf * b, gf * k1, gf * x) {
+  gf y[128], acc[64];  memset(acc, 0, h);
+  for (int i = 0; i < h; i++) y[i] = b[i] + i, y[i + h] = k1[i] + i;
+  for (int j = 0; j < 2 * h; j++) {
+    const gf * m = PROD[y[j]], * col = fwc + h * x[j];
+    for (int i = 0; i < h; i++) acc[i] ^= m[col[i]];
+  }
+  memcpy(b, acc, h);
+}
+WIDTH_INLINE void keysched_width(int h, const gf * kvc,
+    gf * in, gf * k2, gf * out, gf * next) {
+  gf x[64], e[192];  memset(e, 0, 3 * h);
+  for (int j = 0; j < h; j++) {
+    const gf * m = PROD[(gf) (in[j] + j)], * col = kvc + 3 * h * j;
+    for (int t = 0; t < 3 * h; t++) e[t] ^= m[col[t]];
+  }
+  permutation(k2, x, h);
+  for (int i = 0; i < h; i++)
+    out[i] = e[x[i]], next[i] = e[h + x[i]], k2[i] = e[2 * h + x[i]];
+}
+// `k1' holds the three round keys of h bytes, one after another.
+WIDTH_INLINE void feistel_width(int h, const gf * fwc,
+    gf * L, gf * R, gf * k1, gf * k2, int decode) {
+  gf x[128], temp[64];  permutation(k2, x, 2 * h);
+  for (int n = 0; n < 3; n++) {
+    gf * a = decode ? R : L, * b = decode ? L : R;
+    memcpy(temp, b, h);
+    feistelF_width(h, fwc, b, k1 + h * (decode ? 2 - n : n), x);
+    for (int i = 0; i < h; i++) b[i] ^= a[i];
+    memcpy(a, temp, h);
+  }
+}
+static void keysched_matrix(gf in[32], gf k2[64], gf out[32], gf next[32]) {
+  keysched_width(32, KVC[0], in, k2, out, next);
+}
+static void feistel0_matrix(gf L[32], gf R[32], gf k1[3][32], gf k2[64]) {
+  feistel_width(32, FWC[0], L, R, k1[0], k2, 0);
+}
+static void feistel1_matrix(gf L[32], gf R[32], gf k1[3][32], gf k2[64]) {
+  feistel_width(32, FWC[0], L, R, k1[0], k2, 1);
+}
+
+// ---------------------------------------------------------------------------
+//      AVX-512 kernel. The matrix products are evaluated with GFNI, which
+//      multiplies in GF(256) generated by 0x11B. The field generated by
+//      0x11D is mapped to it by an isomorphism, an affine transformation
+//      over GF(2), so the matrices are stored in the image of the map and
+//      only the inputs and outputs of the products need translating. The
+//      permutations are applied with VBMI byte shuffles, and the whole
+//      block stays in registers across the three rounds.
+// ---------------------------------------------------------------------------
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_AVX512_KERNEL
+#include <immintrin.h>
+#define AVX512_TARGET \
+  __attribute__((target("avx512f,avx512bw,avx512vl,avx512vbmi,gfni")))
+static gf FWI[64][32], KVI[32][96], BIDX[32][64];
+static uint64_t ISO_MAT, ISO_INV;
+static gf gf_mul_11b(gf a, gf b) {
+  gf r = 0;
+  for (; b; b >>= 1, a = (a << 1) ^ (a & 0x80 ? 0x1b : 0))
+    if (b & 1) r ^= a;
+  return r;
+}
+static uint64_t affine_matrix(gf col[8]) {
+  uint64_t m = 0;
+  for (int i = 0; i < 8; i++)
+    for (int j = 0; j < 8; j++)
+      m |= (uint64_t) ((col[j] >> i) & 1) << (8 * (7 - i) + j);
+  return m;
+}
+static void genmat_avx512(void) {
+  gf beta = 2, pow[8], ISO[256], ISOI[256], col[8];
+  for (;; beta++) { // A root of x^8 + x^4 + x^3 + x^2 + 1 over 0x11B.
+    gf p = 1;
+    for (int i = 0; i < 8; i++) pow[i] = p, p = gf_mul_11b(p, beta);
+    if (!(p ^ pow[4] ^ pow[3] ^ pow[2] ^ 1)) break;
+  }
+  for (int a = 0; a < 256; a++) {
+    ISO[a] = 0;
+    for (int i = 0; i < 8; i++) if (a >> i & 1) ISO[a] ^= pow[i];
+    ISOI[ISO[a]] = a;
+  }
+  ISO_MAT = affine_matrix(pow);
+  for (int j = 0; j < 8; j++) col[j] = ISOI[1 << j];
+  ISO_INV = affine_matrix(col);
+  for (int a = 0; a < 64; a++)
+    for (int i = 0; i < 32; i++) FWI[a][i] = ISO[FWC[a][i]];
+  for (int j = 0; j < 32; j++)
+    for (int t = 0; t < 96; t++) KVI[j][t] = ISO[KVC[j][t]];
+  for (int j = 0; j < 32; j++)
+    for (int l = 0; l < 64; l++) BIDX[j][l] = l < 32 ? j : j + 32;
+}
+static int avx512_supported(void) {
+  return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+      && __builtin_cpu_supports("avx512vl")
+      && __builtin_cpu_supports("avx512vbmi") && __builtin_cpu_supports("gfni");
+}
+AVX512_TARGET static void keysched_avx512(gf in[32], gf k2[64],
+    gf out[32], gf next[32]) {
+  const __m256i iota = _mm256_setr_epi8(
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+    16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+  gf x[32], ys[32];
+  __m256i y = _mm256_add_epi8(_mm256_loadu_si256((void *) in), iota);
+  y = _mm256_gf2p8affine_epi64_epi8(y, _mm256_set1_epi64x(ISO_MAT), 0);
+  _mm256_storeu_si256((void *) ys, y);
+  __m512i e01 = _mm512_setzero_si512();  __m256i e2 = _mm256_setzero_si256();
+  for (int j = 0; j < 32; j++) {
+    __m512i b = _mm512_set1_epi8(ys[j]);
+    e01 = _mm512_xor_si512(e01,
+      _mm512_gf2p8mul_epi8(_mm512_loadu_si512(KVI[j]), b));
+    e2 = _mm256_xor_si256(e2, _mm256_gf2p8mul_epi8(
+      _mm256_loadu_si256((void *) (KVI[j] + 64)), _mm512_castsi512_si256(b)));
+  }
+  e01 = _mm512_gf2p8affine_epi64_epi8(e01, _mm512_set1_epi64(ISO_INV), 0);
+  e2 = _mm256_gf2p8affine_epi64_epi8(e2, _mm256_set1_epi64x(ISO_INV), 0);
+  permutation(k2, x, 32);
+  __m256i idx = _mm256_loadu_si256((void *) x);
+  __m512i idx2 = _mm512_inserti64x4(_mm512_castsi256_si512(idx),
+    _mm256_add_epi8(idx, _mm256_set1_epi8(32)), 1);
+  __m512i on = _mm512_permutexvar_epi8(idx2, e01);
+  _mm256_storeu_si256((void *) out, _mm512_castsi512_si256(on));
+  _mm256_storeu_si256((void *) next, _mm512_extracti64x4_epi64(on, 1));
+  _mm256_storeu_si256((void *) k2, _mm256_permutexvar_epi8(idx, e2));
+}
+AVX512_TARGET static void feistel_avx512(gf L[32], gf R[32],
+    gf k1[3][32], gf k2[64], int decode) {
+  gf x[64];  permutation(k2, x, 64);
+  __m512i C[32];
+  for (int j = 0; j < 32; j++)
+    C[j] = _mm512_inserti64x4(
+      _mm512_castsi256_si512(_mm256_loadu_si256((void *) FWI[x[j]])),
+      _mm256_loadu_si256((void *) FWI[x[j + 32]]), 1);
+  const __m256i iota = _mm256_setr_epi8(
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+    16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+  const __m512i iso = _mm512_set1_epi64(ISO_MAT);
+  const __m256i inv = _mm256_set1_epi64x(ISO_INV);
+  __m256i l = _mm256_loadu_si256((void *) L), r = _mm256_loadu_si256((void *) R);
+  for (int n = 0; n < 3; n++) {
+    int round = decode ? 2 - n : n;
+    __m256i b = decode ? l : r;
+    __m256i k = _mm256_loadu_si256((void *) k1[round]);
+    __m512i y = _mm512_inserti64x4(
+      _mm512_castsi256_si512(_mm256_add_epi8(b, iota)),
+      _mm256_add_epi8(k, iota), 1);
+    y = _mm512_gf2p8affine_epi64_epi8(y, iso, 0);
+    __m512i acc = _mm512_setzero_si512();
+    for (int j = 0; j < 32; j++)
+      acc = _mm512_xor_si512(acc, _mm512_gf2p8mul_epi8(C[j],
+        _mm512_permutexvar_epi8(_mm512_loadu_si512(BIDX[j]), y)));
+    __m256i f = _mm256_xor_si256(_mm512_castsi512_si256(acc),
+                                 _mm512_extracti64x4_epi64(acc, 1));
+    f = _mm256_gf2p8affine_epi64_epi8(f, inv, 0);
+    if (decode) { __m256i t = l; l = _mm256_xor_si256(f, r); r = t; }
+    else        { __m256i t = r; r = _mm256_xor_si256(f, l); l = t; }
+  }
+  _mm256_storeu_si256((void *) L, l);  _mm256_storeu_si256((void *) R, r);
+}
+static void feistel0_avx512(gf L[32], gf R[32], gf k1[3][32], gf k2[64]) {
+  feistel_avx512(L, R, k1, k2, 0);
+}
+static void feistel1_avx512(gf L[32], gf R[32], gf k1[3][32], gf k2[64]) {
+  feistel_avx512(L, R, k1, k2, 1);
+}
+#endif
+
+// ---------------------------------------------------------------------------
+//      Kernel selection. The reference implementation is used until
+//      `kernel_select' is called, which picks the fastest supported kernel
+//      unless one is requested by name.
+// ---------------------------------------------------------------------------
+typedef struct {
+  const char * name;
+  int (* supported)(void);
+  void (* keysched)(gf in[32], gf k2[64], gf out[32], gf next[32]);
+  void (* feistel0)(gf L[32], gf R[32], gf k1[3][32], gf k2[64]);
+  void (* feistel1)(gf L[32], gf R[32], gf k1[3][32], gf k2[64]);
+} kernel_t;
+static const kernel_t KERNELS[] = {
+#ifdef HAVE_AVX512_KERNEL
+  { "avx512", avx512_supported,
+    keysched_avx512, feistel0_avx512, feistel1_avx512 },
+#endif
+  { "matrix", NULL, keysched_matrix, feistel0_matrix, feistel1_matrix },
+  { "scalar", NULL, keysched, feistel0, feistel1 },
+  { NULL }
+};
+static const kernel_t * kernel = &KERNELS[sizeof(KERNELS) / sizeof(kernel_t) - 2];
+static int kernel_select(const char * name) {
+  static int init = 0;
+  if (!init) {
+    genmat();
+#ifdef HAVE_AVX512_KERNEL
+    genmat_avx512();
+#endif
+    init = 1;
+  }
+  for (const kernel_t * k = KERNELS; k->name; k++)
+    if ((!name || !strcmp(name, k->name)) && (!k->supported || k->supported()))
+      { kernel = k; return 1; }
+  return 0;
+}
+
+// Library entry points call this first; the command-line stub calls it
+// before selecting the kernel it was asked for.
+static void kcrypt3_setup(void) {
+  gentab(0x1d);  kernel_select(NULL);
+}
+void kcrypt3_init(void) {
+#ifdef HAVE_PTHREAD_H
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, kcrypt3_setup);
+#else
+  static int init = 0;
+  if (!init) kcrypt3_setup(), init = 1;
+#endif
+}
+
+// Blocks of `w' bytes: 64, processed by the selected kernel, or 128, which
+// only the matrix kernel supports. The key state is w/2 combining bytes
+// `k1' and w permuting bytes `k2', and `keys' receives the three round keys
+// of w/2 bytes, one after another.
+static void schedule_block(int w, uint32_t IV, gf * k1, gf * k2, gf * keys) {
+  for (int i = 0; i < 4; i++) k1[i] += (IV >> (i * 8)) & 0xff;
+  for (int r = 0; r < 3; r++, keys += w / 2)
+    if (w == 64) kernel->keysched(k1, k2, keys, k1);
+    else keysched_width(64, KVC128[0], k1, k2, keys, k1);
+}
+static void feistel_block(int w, gf * blk, gf * keys, gf * k2, int decode) {
+  if (w != 64)
+    feistel_width(64, FWC128[0], blk, blk + 64, keys, k2, decode);
+  else if (decode)
+    kernel->feistel1(blk, blk + 32, (gf (*)[32]) keys, k2);
+  else
+    kernel->feistel0(blk, blk + 32, (gf (*)[32]) keys, k2);
+}
+static void block_keys(uint32_t IV, block_key_t * key, gf keys[3][32]) {
+  schedule_block(64, IV, key->k1, key->k2, keys[0]);
+}
 static void encode_block(gf in[64], gf blk[64], uint32_t IV, block_key_t * key) {
   gf keys[3][32];  memcpy(blk, in, 64);
-  for (int i = 0; i < 4; i++) key->k1[i] += (IV >> (i * 8)) & 0xff;
-  keysched(key->k1, key->k2, keys[0], key->k1);
-  keysched(key->k1, key->k2, keys[1], key->k1);
-  keysched(key->k1, key->k2, keys[2], key->k1);
-  feistel0(blk, blk + 32, keys, key->k2);
+  block_keys(IV, key, keys);
+  kernel->feistel0(blk, blk + 32, keys, key->k2);
+}
+// Key material for a purpose other than encoding a stream. The label is
+// mixed into the combining state past the bytes that the IV and the sector
+// number are added to, so that no stream or sector is ever encoded under
+// the key state the material is drawn from.
+static void derive_key(block_key_t * key, const char * label,
+    gf * out, size_t len) {
+  block_key_t k = *key;  gf zero[64] = { 0 }, blk[64];
+  for (int i = 0; label[i] && i < 24; i++) k.k1[8 + i] ^= label[i];
+  for (size_t i = 0; i < len; i += 64) {
+    encode_block(zero, blk, i / 64, &k);
+    memcpy(out + i, blk, len - i < 64 ? len - i : 64);
+  }
 }
+#ifndef KCRYPT3_LIBRARY // Single blocks are only decoded by the streams.
 static void decode_block(gf in[64], gf blk[64], uint32_t IV, block_key_t * key) {
   gf keys[3][32];  memcpy(blk, in, 64);
-  for (int i = 0; i < 4; i++) key->k1[i] += (IV >> (i * 8)) & 0xff;
-  keysched(key->k1, key->k2, keys[0], key->k1);
-  keysched(key->k1, key->k2, keys[1], key->k1);
-  keysched(key->k1, key->k2, keys[2], key->k1);
-  feistel1(blk, blk + 32, keys, key->k2);
+  block_keys(IV, key, keys);
+  kernel->feistel1(blk, blk + 32, keys, key->k2);
 }
+// The key state does not depend on the data, so it can be fast-forwarded
+// over a block without running the (considerably more expensive) Feistel
+// network.
+static void skip_block(uint32_t IV, block_key_t * key) {
+  gf keys[3][32];  block_keys(IV, key, keys);
+}
+#endif
 
 // ---------------------------------------------------------------------------
 //      Secure randomness source. Supports `dows, DOS and Unix systems.
@@ -155,6 +482,15 @@ static void secrandom(void * buf, size_t len) {
 #elif __unix__
 #include <fcntl.h>
 #include <unistd.h>
+#if defined(HAVE_SYS_RANDOM_H) && defined(HAVE_GETRANDOM)
+#include <sys/random.h>
+static void secrandom(void * buf, size_t len) {
+  for (ssize_t n; len > 0; buf = (char *) buf + n, len -= n)
+    if ((n = getrandom(buf, len, 0)) < 0 && errno != EINTR)
+      eprintf("Could not obtain random data: %s\n", strerror(errno));
+    else if (n < 0) n = 0;
+}
+#else
 static void secrandom(void * buf, size_t len) {
   int fd = open("/dev/urandom", O_RDONLY);
   if (fd < 0)
@@ -163,6 +499,7 @@ static void secrandom(void * buf, size_t len) {
     eprintf("Could not read from `/dev/urandom': %s\n", strerror(errno));
   close(fd);
 }
+#endif
 #elif __MSDOS__
 static void secrandom(void * buf, size_t len) { // Doug Kaufman's NOISE.SYS
   FILE * f = fopen("/dev/urandom$", "rb");
@@ -174,6 +511,241 @@ static void secrandom(void * buf, size_t len) { // Doug Kaufman's NOISE.SYS
 }
 #endif
 
+// ---------------------------------------------------------------------------
+//      Multi-block engine. The key schedule is inherently serial, but once
+//      the round keys of a run of blocks are known, their Feistel networks
+//      are independent and are evaluated in place by a number of threads.
+//      The round keys of a block of `w' bytes take 5w/2 bytes: the three
+//      round keys followed by the permuting state.
+// ---------------------------------------------------------------------------
+#define ENGINE_BATCH 64
+typedef struct {
+  gf * blk, * rk;
+  size_t n;
+  int w, decode;
+} engine_job_t;
+static void run_jobs(void * (* fn)(void *), void * jobs, size_t size, int n) {
+#ifdef HAVE_PTHREAD_H
+  pthread_t tid[n];
+  for (int t = 1; t < n; t++)
+    if (pthread_create(&tid[t], NULL, fn, (char *) jobs + t * size) != 0)
+      eprintf("Could not create a thread.\n");
+  fn(jobs);
+  for (int t = 1; t < n; t++)
+    pthread_join(tid[t], NULL);
+#else
+  for (int t = 0; t < n; t++)
+    fn((char *) jobs + t * size);
+#endif
+}
+static void * engine_worker(void * arg) {
+  engine_job_t * job = arg;  int w = job->w;
+  for (size_t i = 0; i < job->n; i++) {
+    gf * rk = job->rk + 5 * w / 2 * i;
+    feistel_block(w, job->blk + w * i, rk, rk + 3 * w / 2, job->decode);
+  }
+  return NULL;
+}
+static void engine_run_width(int w, gf * blk, size_t n, uint32_t IV,
+    gf * k1, gf * k2, int decode, int threads) {
+  gf * rk = malloc(n * 5 * w / 2);
+  if (n && !rk) eprintf("Out of memory.\n");
+  for (size_t i = 0; i < n; i++) {
+    schedule_block(w, IV + i, k1, k2, rk + 5 * w / 2 * i);
+    memcpy(rk + 5 * w / 2 * i + 3 * w / 2, k2, w);
+  }
+  if (threads > (int) n) threads = n;
+  if (threads < 1) threads = 1;
+  engine_job_t job[threads];
+  for (int t = 0; t < threads; t++) {
+    size_t lo = n * t / threads, hi = n * (t + 1) / threads;
+    job[t] = (engine_job_t) {
+      blk + w * lo, rk + 5 * w / 2 * lo, hi - lo, w, decode
+    };
+  }
+  run_jobs(engine_worker, job, sizeof(job[0]), threads);
+  free(rk);
+}
+static void engine_run(gf * blk, size_t n, uint32_t IV, block_key_t * key,
+    int decode, int threads) {
+  engine_run_width(64, blk, n, IV, key->k1, key->k2, decode, threads);
+}
+
+// ---------------------------------------------------------------------------
+//      Multi-key interface. Processes blocks of many independent streams,
+//      each with its own key state and IV, in one call. The streams share
+//      no state, so unlike within a single stream, their key schedules run
+//      in parallel too: the requests are spread over the threads evenly by
+//      block count. Blocks are transformed in place as in the CTR mode and
+//      the key state and IV of every request are advanced past them, so a
+//      stream can be continued by a later call. Requests sharing a key
+//      state are kept on one thread and processed in the order given.
+// ---------------------------------------------------------------------------
+typedef struct {
+  multi_req_t ** req; // Requests sharing a key are adjacent.
+  size_t n;
+  int decode;
+} multi_job_t;
+static void * multi_worker(void * arg) {
+  multi_job_t * job = arg;
+  for (size_t i = 0; i < job->n; i++) {
+    multi_req_t * r = job->req[i];
+    engine_run(r->blk, r->n, r->IV, r->key, job->decode, 1);
+    r->IV += r->n;
+  }
+  return NULL;
+}
+static int multi_compare(const void * a, const void * b) {
+  const multi_req_t * x = *(multi_req_t **) a, * y = *(multi_req_t **) b;
+  if (x->key != y->key)
+    return (uintptr_t) x->key < (uintptr_t) y->key ? -1 : 1;
+  return x < y ? -1 : x > y;
+}
+static void multi_run(multi_req_t * req, size_t n, int decode, int threads) {
+  size_t total = 0, done = 0, i = 0;
+  multi_req_t ** order = malloc(n * sizeof(multi_req_t *));
+  if (n && !order) eprintf("Out of memory.\n");
+  for (size_t j = 0; j < n; j++) total += req[j].n, order[j] = &req[j];
+  qsort(order, n, sizeof(multi_req_t *), multi_compare);
+  if (threads > (int) n) threads = n;
+  if (threads < 1) threads = 1;
+  multi_job_t job[threads];
+  for (int t = 0; t < threads; t++) {
+    size_t lo = i;
+    while (i < n && (t == threads - 1 || done < total * (t + 1) / threads
+        || (i > 0 && order[i]->key == order[i - 1]->key)))
+      done += order[i++]->n;
+    job[t] = (multi_job_t) { order + lo, i - lo, decode };
+  }
+  run_jobs(multi_worker, job, sizeof(job[0]), threads);
+  free(order);
+}
+void encode_multi(multi_req_t * req, size_t n, int threads) {
+  kcrypt3_init();  multi_run(req, n, 0, threads);
+}
+void decode_multi(multi_req_t * req, size_t n, int threads) {
+  kcrypt3_init();  multi_run(req, n, 1, threads);
+}
+
+// ---------------------------------------------------------------------------
+//      Sector mode. Length-preserving and without a header: every sector
+//      is encoded on its own, starting from a key state derived for the
+//      sector mode with the sector number injected as the IV, so that any
+//      sector can be read or rewritten independently. Starting from the
+//      key itself, sector s would be encoded exactly as a stream with the
+//      IV s. Sectors are spread over the threads. The sector size must be
+//      a multiple of 64, as must the input size. The IV only holds the low
+//      32 bits of the sector number; the high ones are added to the
+//      following bytes of the combining state, so that the tweaks of large
+//      images do not wrap around.
+// ---------------------------------------------------------------------------
+static void sector_base(block_key_t * key, block_key_t * base) {
+  derive_key(key, "sector", (gf *) base, sizeof(block_key_t));
+}
+static void sector_run(block_key_t * base, uint64_t sector, gf * buf,
+    size_t size, int decode) {
+  block_key_t k = *base;
+  for (int i = 4; i < 8; i++) k.k1[i] += (sector >> (i * 8)) & 0xff;
+  engine_run(buf, size / 64, sector, &k, decode, 1);
+}
+void encode_sector(block_key_t * key, uint64_t sector, gf * buf, size_t size) {
+  block_key_t base;  kcrypt3_init();  sector_base(key, &base);
+  sector_run(&base, sector, buf, size, 0);
+}
+void decode_sector(block_key_t * key, uint64_t sector, gf * buf, size_t size) {
+  block_key_t base;  kcrypt3_init();  sector_base(key, &base);
+  sector_run(&base, sector, buf, size, 1);
+}
+
+// ---------------------------------------------------------------------------
+//      Record-oriented batch interface. Encodes many short messages under
+//      a single key, each into a self-contained KC3CTR stream that can be
+//      decoded independently (also by `kcrypt3 -d'). The IVs of the whole
+//      batch are drawn from the randomness source at once, and the records
+//      are processed by the multi-key engine, each with its own copy of the
+//      key. A malformed record fails on its own.
+// ---------------------------------------------------------------------------
+static void write32_le_buf(uint32_t val, gf * buf) {
+  for (int i = 0; i < 4; i++)
+    buf[i] = (val >> (i * 8)) & 0xff;
+}
+static void read32_le_buf(uint32_t * val, gf * buf) {
+  *val = 0;
+  for (int i = 0; i < 4; i++)
+    *val |= buf[i] << (i * 8);
+}
+uint32_t record_size(uint32_t len) {
+  return 10 + (len / 63 + 1) * 64;
+}
+static void records_run(block_key_t * key, size_t n, gf ** blk,
+    uint32_t * IV, size_t * blocks, int decode, int threads) {
+  multi_req_t * req = malloc(n * sizeof(multi_req_t));
+  block_key_t * k = malloc(n * sizeof(block_key_t));
+  if (n && (!req || !k)) eprintf("Out of memory.\n");
+  for (size_t i = 0; i < n; i++)
+    k[i] = *key, req[i] = (multi_req_t) { &k[i], IV[i], blk[i], blocks[i] };
+  multi_run(req, n, decode, threads);
+  free(req);  free(k);
+}
+void encode_records(block_key_t * key, size_t n, gf ** msg,
+    uint32_t * len, gf ** rec, int threads) {
+  uint32_t * IV = malloc(n * sizeof(uint32_t));
+  size_t * blocks = malloc(n * sizeof(size_t));
+  gf ** blk = malloc(n * sizeof(gf *));
+  if (n && (!IV || !blocks || !blk)) eprintf("Out of memory.\n");
+  kcrypt3_init();
+  secrandom(IV, n * sizeof(uint32_t));
+  for (size_t i = 0; i < n; i++) {
+    memcpy(rec[i], "KC3CTR", 6);  write32_le_buf(IV[i], rec[i] + 6);
+    blk[i] = rec[i] + 10;  blocks[i] = len[i] / 63 + 1;
+    for (size_t j = 0; j < blocks[i]; j++) {
+      gf * b = blk[i] + 64 * j;
+      uint32_t read = len[i] - 63 * j < 63 ? len[i] - 63 * j : 63;
+      memcpy(b, msg[i] + 63 * j, read);
+      memset(b + read, 63 - read, 63 - read);  b[63] = read;
+    }
+  }
+  records_run(key, n, blk, IV, blocks, 0, threads);
+  free(IV);  free(blocks);  free(blk);
+}
+size_t decode_records(block_key_t * key, size_t n, gf ** rec,
+    uint32_t * rec_len, gf ** out, uint32_t * len, int * err, int threads) {
+  uint32_t * IV = malloc(n * sizeof(uint32_t));
+  size_t * blocks = malloc(n * sizeof(size_t)), failed = 0;
+  if (n && (!IV || !blocks)) eprintf("Out of memory.\n");
+  kcrypt3_init();
+  for (size_t i = 0; i < n; i++) {
+    blocks[i] = 0;  len[i] = 0;  err[i] = KCRYPT3_OK;
+    if (rec_len[i] < 74 || (rec_len[i] - 10) % 64
+        || memcmp(rec[i], "KC3CTR", 6)) {
+      err[i] = KCRYPT3_EFORMAT;
+      continue;
+    }
+    read32_le_buf(&IV[i], rec[i] + 6);
+    blocks[i] = (rec_len[i] - 10) / 64;
+    memcpy(out[i], rec[i] + 10, rec_len[i] - 10);
+  }
+  records_run(key, n, out, IV, blocks, 1, threads);
+  // Every block but the last carries 63 bytes, the last one fewer, and
+  // the padding repeats its length.
+  for (size_t i = 0; i < n; i++) {
+    for (size_t j = 0; j < blocks[i] && err[i] == KCRYPT3_OK; j++) {
+      gf * b = out[i] + 64 * j, read = b[63];
+      if (read > 63 || (read == 63) != (j < blocks[i] - 1))
+        err[i] = KCRYPT3_ECORRUPT;
+      for (int t = read; t < 63 && err[i] == KCRYPT3_OK; t++)
+        if (b[t] != 63 - read) err[i] = KCRYPT3_ECORRUPT;
+      if (err[i] != KCRYPT3_OK) break; // The count is not to be trusted.
+      memmove(out[i] + len[i], b, read);  len[i] += read;
+    }
+    if (err[i] != KCRYPT3_OK) failed++, len[i] = 0;
+  }
+  free(IV);  free(blocks);
+  return failed;
+}
+
+// The rest is only used by the command-line tool.
+#ifndef KCRYPT3_LIBRARY
 // ---------------------------------------------------------------------------
 //      Stream ciphers.
 // ---------------------------------------------------------------------------
@@ -195,15 +767,6 @@ typedef struct {
     };
   };
 } cipher_aux_t;
-static void write32_le_buf(uint32_t val, gf * buf) {
-  for (int i = 0; i < 4; i++)
-    buf[i] = (val >> (i * 8)) & 0xff;
-}
-static void read32_le_buf(uint32_t * val, gf * buf) {
-  *val = 0;
-  for (int i = 0; i < 4; i++)
-    *val |= buf[i] << (i * 8);
-}
 static size_t cipher_aux_fread(void * ptr, size_t size,
     size_t nmemb, cipher_aux_t * stream) {
   if (stream->type == CIPHER_STREAM_FILE) {
@@ -215,7 +778,7 @@ static size_t cipher_aux_fread(void * ptr, size_t size,
     return stream->stream.read(ptr, size, nmemb, stream->stream.stream);
   }
   if (stream->consumed + size * nmemb > stream->size)
-    eprintf("Internal error.\n");
+    nmemb = (stream->size - stream->consumed) / size;
   memcpy(ptr, stream->buffer + stream->consumed, size * nmemb);
   stream->consumed += size * nmemb;
   return nmemb;
@@ -237,6 +800,37 @@ static size_t cipher_aux_fwrite(const void * ptr, size_t size,
   stream->consumed += size * nmemb;
   return nmemb;
 }
+static int cipher_aux_fskip(cipher_aux_t * stream, uint64_t bytes) {
+  if (stream->type == CIPHER_STREAM_FILE
+      && fseek(stream->file, bytes, SEEK_CUR) == 0)
+    return 1;
+  if (stream->type == CIPHER_STREAM_BLOCK) {
+    if (stream->consumed + bytes > stream->size)
+      return 0;
+    stream->consumed += bytes;
+    return 1;
+  }
+  gf buf[4096];
+  while (bytes > 0) {
+    size_t chunk = bytes < sizeof(buf) ? bytes : sizeof(buf);
+    if (cipher_aux_fread(buf, 1, chunk, stream) != chunk)
+      return 0;
+    bytes -= chunk;
+  }
+  return 1;
+}
+// Number of bytes left in the stream, or UINT64_MAX if it is not known.
+static uint64_t cipher_aux_left(cipher_aux_t * stream) {
+  if (stream->type == CIPHER_STREAM_BLOCK)
+    return stream->size - stream->consumed;
+  long pos, end;
+  if (stream->type != CIPHER_STREAM_FILE || (pos = ftell(stream->file)) < 0
+      || fseek(stream->file, 0, SEEK_END) != 0)
+    return UINT64_MAX;
+  end = ftell(stream->file);
+  fseek(stream->file, pos, SEEK_SET);
+  return end > pos ? end - pos : 0;
+}
 static uint32_t cipher_aux_ftell(cipher_aux_t * stream) {
   if (stream->type == CIPHER_STREAM_FILE)
     return ftell(stream->file);
@@ -250,8 +844,20 @@ typedef struct {
   fprogress_cb pcb;
   block_key_t key;
   cipher_aux_t input, output;
+  uint64_t range_start, range_end; // Plaintext range to decode; 0 = all.
+  int compress;
+  int threads, batch; // Multi-block engine; 0 = defaults.
+  size_t sector;
+  FILE * previous; // Previous output in the incremental mode.
+  int flush_ms; // Streaming mode: deadline and threshold for flushing.
+  size_t flush_bytes;
 } mode_params_t;
 
+static size_t engine_blocks(mode_params_t * params) {
+  return (params->batch > 0 ? params->batch : ENGINE_BATCH)
+       * (params->threads > 1 ? params->threads : 1);
+}
+
 typedef void (* stream_enc)(mode_params_t * params);
 typedef void (* stream_dec)(mode_params_t * params);
 
@@ -270,50 +876,181 @@ static uint32_t cipher_put_header(char * hdr, mode_params_t * params) {
   return IV;
 }
 
+// ---------------------------------------------------------------------------
+//      Random-access decoding. Every block except the last one carries
+//      exactly 63 bytes of plaintext, so the block holding a given offset
+//      is known in advance. The key state is fast-forwarded to it and the
+//      preceding ciphertext is skipped. OFB additionally needs the block
+//      preceding the first one decoded, which is read into `prev'.
+// ---------------------------------------------------------------------------
+static uint64_t cipher_seek_range(mode_params_t * params,
+    uint32_t * IV, gf prev[64]) {
+  uint64_t block = params->range_start / 63;
+  uint64_t left = cipher_aux_left(&params->input);
+  // A range starting past the end of the plaintext is sought to the last
+  // block, which is then decoded into nothing.
+  if (left != UINT64_MAX && left >= 64 && block > left / 64 - 1)
+    block = left / 64 - 1;
+  if (block == 0) return 0;
+  if (!cipher_aux_fskip(&params->input, (block - (prev != NULL)) * 64))
+    eprintf("The range starts past the end of the input.\n");
+  if (prev && cipher_aux_fread(prev, 1, 64, &params->input) != 64)
+    eprintf("Truncated input.\n");
+  for (uint64_t i = 0; i < block; i++)
+    skip_block((*IV)++, &params->key);
+  return block * 63;
+}
+// A decoded block of `w' bytes carries `read' bytes of plaintext followed
+// by padding, every byte of which holds the number of bytes missing. A
+// wrong key is caught here rather than by a short block ending the stream
+// early, and so is anything left in the input after the final block.
+static void cipher_check_block(gf * blk, int w, int read) {
+  if (read > w - 1)
+    eprintf("Wrong key or corrupted input.\n");
+  for (int i = read; i < w - 1; i++)
+    if (blk[i] != w - 1 - read)
+      eprintf("Wrong key or corrupted input.\n");
+}
+static void cipher_check_end(mode_params_t * params, size_t left) {
+  gf c;
+  if (left || cipher_aux_fread(&c, 1, 1, &params->input) == 1)
+    eprintf("Wrong key or corrupted input: trailing data.\n");
+}
+static int cipher_range_fwrite(gf * buf, size_t len, uint64_t * pos,
+    mode_params_t * params) {
+  uint64_t base = *pos, start = base, end = base + len;  *pos = end;
+  if (!params->range_end) {
+    cipher_aux_fwrite(buf, 1, len, &params->output);
+    return 0;
+  }
+  if (start < params->range_start) start = params->range_start;
+  if (end > params->range_end) end = params->range_end;
+  if (start < end)
+    cipher_aux_fwrite(buf + (start - base), 1, end - start, &params->output);
+  return *pos >= params->range_end;
+}
+
+// Number of blocks worth reading in one go, short of the end of the range.
+static size_t cipher_range_blocks(mode_params_t * params, uint64_t pos,
+    size_t batch) {
+  if (!params->range_end) return batch;
+  uint64_t left = (params->range_end - pos) / 63 + 1;
+  return left < batch ? left : batch;
+}
+
+// Appending to an existing stream, open for update as the output file.
+// The key state is fast-forwarded to the last block, which is decoded into
+// `last' and rewritten by the caller together with the new data. For OFB,
+// `prev' receives the ciphertext of the block preceding the last one.
+static uint32_t cipher_resume(mode_params_t * params, gf last[64],
+    int8_t * read, gf prev[64]) {
+  FILE * f = params->output.file;
+  uint32_t IV; gf hdr[4], in[64];
+  if (fread(hdr, 1, 4, f) != 4)
+    eprintf("Truncated input.\n");
+  read32_le_buf(&IV, hdr);
+  if (fseek(f, 0, SEEK_END) != 0)
+    eprintf("Could not seek in the output file: %s\n", strerror(errno));
+  long size = ftell(f) - 10;
+  if (size < 64 || size % 64)
+    eprintf("Truncated input.\n");
+  uint64_t blocks = size / 64;
+  for (uint64_t i = 0; i < blocks - 1; i++)
+    skip_block(IV++, &params->key);
+  if (prev) memset(prev, 0, 64);
+  fseek(f, 10 + (blocks - 1 - (prev && blocks > 1)) * 64, SEEK_SET);
+  if (prev && blocks > 1 && fread(prev, 1, 64, f) != 64)
+    eprintf("Truncated input.\n");
+  if (fread(in, 1, 64, f) != 64)
+    eprintf("Truncated input.\n");
+  block_key_t key = params->key;
+  decode_block(in, last, IV, &key);
+  if (prev)
+    for (int i = 0; i < 64; i++) last[i] ^= prev[i];
+  cipher_check_block(last, 64, *read = last[63]);
+  if (*read == 63) {
+    // Not terminated by a partial block; continue after the last one.
+    params->key = key;  IV++;  *read = 0;
+    if (prev) memcpy(prev, in, 64);
+  } else if (fseek(f, -64, SEEK_CUR) != 0)
+    eprintf("Could not seek in the output file: %s\n", strerror(errno));
+  fseek(f, 0, SEEK_CUR);
+  return IV;
+}
+
 // ---------------------------------------------------------------------------
 //      CTR mode of operation. Assumes buffers are aligned to 32 bytes.
 // ---------------------------------------------------------------------------
-static void encode_ctr(mode_params_t * params) {
-  uint32_t IV = cipher_put_header("KC3CTR", params);
-  gf in[64] = { 0 }, out[64]; int8_t read = 0;
-  while ((read = cipher_aux_fread(in, 1, 63, &params->input)) > 0) {
-    for (int8_t i = read; i < 63; i++) in[i] = 63 - read;  in[63] = read;
-    encode_block(in, out, IV, &params->key);
+static void encode_ctr_from(mode_params_t * params, uint32_t IV,
+    gf in[64], int8_t read) {
+  size_t batch = engine_blocks(params);
+  gf * buf = malloc(64 * batch);
+  if (!buf) eprintf("Out of memory.\n");
+  memcpy(buf, in, read);
+  for (int last = 0; !last; ) {
+    size_t n = 0;
+    while (n < batch && !last) {
+      gf * blk = buf + 64 * n++;
+      read += cipher_aux_fread(blk + read, 1, 63 - read, &params->input);
+      for (int8_t i = read; i < 63; i++) blk[i] = 63 - read;  blk[63] = read;
+      last = read < 63;  read = 0;
+    }
+    engine_run(buf, n, IV, &params->key, 0, params->threads);
     if (params->pcb)
       params->pcb(cipher_aux_ftell(&params->input), params->input.max);
-    cipher_aux_fwrite(out, 1, 64, &params->output);
-    IV++;
+    cipher_aux_fwrite(buf, 64, n, &params->output);
+    IV += n;
   }
+  free(buf);
+}
+
+static void encode_ctr(mode_params_t * params) {
+  uint32_t IV = cipher_put_header(params->compress ? "KC3CTZ" : "KC3CTR",
+    params);
+  gf in[64] = { 0 };
+  encode_ctr_from(params, IV, in, 0);
+}
+
+static void append_ctr(mode_params_t * params) {
+  gf in[64]; int8_t read;
+  uint32_t IV = cipher_resume(params, in, &read, NULL);
+  encode_ctr_from(params, IV, in, read);
 }
 
 static void decode_ctr(mode_params_t * params) {
   uint32_t IV = cipher_check_header(params);
-  gf in[64], out[64]; int8_t read = 63;
-  while (read == 63) {
-    if (cipher_aux_fread(in, 1, 64, &params->input) != 64)
-      eprintf("Truncated input.\n");
-    decode_block(in, out, IV, &params->key);
+  uint64_t pos = cipher_seek_range(params, &IV, NULL);
+  size_t batch = engine_blocks(params);
+  gf * buf = malloc(64 * batch);
+  if (!buf) eprintf("Out of memory.\n");
+  for (int done = 0; !done; ) {
+    size_t want = cipher_range_blocks(params, pos, batch);
+    size_t n = cipher_aux_fread(buf, 64, want, &params->input);
+    engine_run(buf, n, IV, &params->key, 1, params->threads);
     if (params->pcb)
       params->pcb(cipher_aux_ftell(&params->input), params->input.max);
-    cipher_aux_fwrite(out, 1, read = out[63], &params->output);
-    IV++;
+    for (size_t i = 0; i < n && !done; i++) {
+      gf * out = buf + 64 * i;
+      cipher_check_block(out, 64, out[63]);
+      done = cipher_range_fwrite(out, out[63], &pos, params);
+      if (!done && out[63] < 63)
+        cipher_check_end(params, n - 1 - i), done = 1;
+    }
+    if (!done && n < want)
+      eprintf("Truncated input.\n");
+    IV += n;
   }
+  free(buf);
 }
 
 // ---------------------------------------------------------------------------
 //      OFB mode of operation. Assumes buffers are aligned to 64 bytes.
 // ---------------------------------------------------------------------------
-static void encode_ofb(mode_params_t * params) {
-  uint32_t IV = cipher_put_header("KC3OFB", params);
-  gf in[64] = { 0 }, out[64], prev_out[64]; int8_t read;
-  read = cipher_aux_fread(in, 1, 63, &params->input);
-  for (int8_t i = read; i < 63; i++) in[i] = 63 - read;  in[63] = read;
-  encode_block(in, prev_out, IV, &params->key);
-  if (params->pcb)
-    params->pcb(cipher_aux_ftell(&params->input), params->input.max);
-  cipher_aux_fwrite(prev_out, 1, 64, &params->output);
-  IV++;
-  while ((read = cipher_aux_fread(in, 1, 63, &params->input)) > 0) {
+static void encode_ofb_from(mode_params_t * params, uint32_t IV,
+    gf in[64], int8_t read, gf prev_out[64]) {
+  gf out[64];
+  for (;;) {
+    read += cipher_aux_fread(in + read, 1, 63 - read, &params->input);
     for (int8_t i = read; i < 63; i++) in[i] = 63 - read;  in[63] = read;
     for (int i = 0; i < 64; i++) in[i] ^= prev_out[i];
     encode_block(in, out, IV, &params->key);
@@ -322,52 +1059,988 @@ static void encode_ofb(mode_params_t * params) {
     cipher_aux_fwrite(out, 1, 64, &params->output);
     IV++;
     memcpy(prev_out, out, 64);
+    if (read < 63) break;
+    read = 0;
   }
 }
 
+static void encode_ofb(mode_params_t * params) {
+  uint32_t IV = cipher_put_header(params->compress ? "KC3OFZ" : "KC3OFB",
+    params);
+  gf in[64] = { 0 }, prev_out[64] = { 0 };
+  encode_ofb_from(params, IV, in, 0, prev_out);
+}
+
+static void append_ofb(mode_params_t * params) {
+  gf in[64], prev_out[64]; int8_t read;
+  uint32_t IV = cipher_resume(params, in, &read, prev_out);
+  encode_ofb_from(params, IV, in, read, prev_out);
+}
+
 static void decode_ofb(mode_params_t * params) {
   uint32_t IV = cipher_check_header(params);
-  gf in[64], prev_in[64], out[64]; int8_t read;
-  if (cipher_aux_fread(prev_in, 1, 64, &params->input) != 64)
-    eprintf("Truncated input.\n");
-  decode_block(prev_in, out, IV, &params->key);
+  gf prev_in[64] = { 0 };
+  uint64_t pos = cipher_seek_range(params, &IV, prev_in);
+  size_t batch = engine_blocks(params);
+  gf * buf = malloc(128 * batch), * in = buf + 64 * batch;
+  if (!buf) eprintf("Out of memory.\n");
+  for (int done = 0; !done; ) {
+    size_t want = cipher_range_blocks(params, pos, batch);
+    size_t n = cipher_aux_fread(in, 64, want, &params->input);
+    memcpy(buf, in, 64 * n);
+    engine_run(buf, n, IV, &params->key, 1, params->threads);
+    if (params->pcb)
+      params->pcb(cipher_aux_ftell(&params->input), params->input.max);
+    for (size_t i = 0; i < n && !done; i++) {
+      gf * out = buf + 64 * i, * prev = i ? in + 64 * (i - 1) : prev_in;
+      for (int j = 0; j < 64; j++) out[j] ^= prev[j];
+      cipher_check_block(out, 64, out[63]);
+      done = cipher_range_fwrite(out, out[63], &pos, params);
+      if (!done && out[63] < 63)
+        cipher_check_end(params, n - 1 - i), done = 1;
+    }
+    if (!done && n < want)
+      eprintf("Truncated input.\n");
+    if (n) memcpy(prev_in, in + 64 * (n - 1), 64);
+    IV += n;
+  }
+  free(buf);
+}
+
+// ---------------------------------------------------------------------------
+//      Wide-block CTR mode. As the regular CTR mode, but every block
+//      carries 127 bytes of plaintext followed by their count. The blocks
+//      are 128 bytes wide and the key state (64 combining and 128 permuting
+//      bytes) is derived from the regular key.
+// ---------------------------------------------------------------------------
+typedef struct { gf k1[64]; gf k2[128]; } wide_key_t;
+static void wide_derive(block_key_t * key, wide_key_t * wk) {
+  derive_key(key, "wide block", (gf *) wk, sizeof(wide_key_t));
+}
+static void encode_ctr128(mode_params_t * params) {
+  uint32_t IV = cipher_put_header(params->compress ? "KC3CWZ" : "KC3CWB",
+    params);
+  wide_key_t key;  wide_derive(&params->key, &key);
+  size_t batch = engine_blocks(params);
+  gf * buf = malloc(128 * batch);
+  if (!buf) eprintf("Out of memory.\n");
+  for (int last = 0; !last; ) {
+    size_t n = 0;
+    while (n < batch && !last) {
+      gf * blk = buf + 128 * n++;
+      int read = cipher_aux_fread(blk, 1, 127, &params->input);
+      for (int i = read; i < 127; i++) blk[i] = 127 - read;
+      blk[127] = read;  last = read < 127;
+    }
+    engine_run_width(128, buf, n, IV, key.k1, key.k2, 0, params->threads);
+    if (params->pcb)
+      params->pcb(cipher_aux_ftell(&params->input), params->input.max);
+    cipher_aux_fwrite(buf, 128, n, &params->output);
+    IV += n;
+  }
+  free(buf);
+}
+static void decode_ctr128(mode_params_t * params) {
+  uint32_t IV = cipher_check_header(params);
+  wide_key_t key;  wide_derive(&params->key, &key);
+  size_t batch = engine_blocks(params);
+  uint64_t pos = 0;
+  gf * buf = malloc(128 * batch);
+  if (!buf) eprintf("Out of memory.\n");
+  for (int done = 0; !done; ) {
+    size_t n = cipher_aux_fread(buf, 128, batch, &params->input);
+    engine_run_width(128, buf, n, IV, key.k1, key.k2, 1, params->threads);
+    if (params->pcb)
+      params->pcb(cipher_aux_ftell(&params->input), params->input.max);
+    for (size_t i = 0; i < n && !done; i++) {
+      gf * out = buf + 128 * i;
+      cipher_check_block(out, 128, out[127]);
+      done = cipher_range_fwrite(out, out[127], &pos, params);
+      if (!done && out[127] < 127)
+        cipher_check_end(params, n - 1 - i), done = 1;
+    }
+    if (!done && n < batch)
+      eprintf("Truncated input.\n");
+    IV += n;
+  }
+  free(buf);
+}
+
+// ---------------------------------------------------------------------------
+//      Streaming mode, for pipes and tunnels. As the CTR mode, but a block
+//      carrying fewer than 63 bytes does not end the stream: the encoder
+//      emits one whenever data has been pending for longer than the
+//      deadline or exceeds the byte threshold, and flushes the output.
+//      The final block has the high bit of its count set. The encoder
+//      waits for the input with `poll', so that it never blocks on a
+//      partial block; data arriving quickly is still encoded in batches.
+// ---------------------------------------------------------------------------
+#if defined(__unix__) && defined(HAVE_POLL_H)
+#define HAVE_STREAM_MODE
+#include <poll.h>
+static int64_t stream_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+#endif
+// Whether more input can be read without blocking. Data in the buffers of
+// stdio is not visible to `poll', which only makes the batch smaller.
+static int stream_ready(cipher_aux_t * input) {
+#ifdef HAVE_STREAM_MODE
+  if (input->type == CIPHER_STREAM_FILE) {
+    struct pollfd p = { .fd = fileno(input->file), .events = POLLIN };
+    return poll(&p, 1, 0) > 0;
+  }
+#endif
+  return 1;
+}
+static void stream_flush(mode_params_t * params) {
+  if (params->output.type == CIPHER_STREAM_FILE
+      && fflush(params->output.file) != 0)
+    eprintf("Could not write to the output file: %s\n", strerror(errno));
+}
+#ifdef HAVE_STREAM_MODE
+static void stream_emit(mode_params_t * params, gf * buf, size_t len,
+    uint32_t * IV, int final) {
+  size_t n = len / 63 + (len % 63 || final);
+  for (size_t i = n; i-- > 0; ) {
+    size_t read = len - 63 * i < 63 ? len - 63 * i : 63;
+    gf * blk = buf + 64 * i;
+    memmove(blk, buf + 63 * i, read);
+    for (size_t j = read; j < 63; j++) blk[j] = 63 - read;
+    blk[63] = read | (final && i == n - 1 ? 0x80 : 0);
+  }
+  engine_run(buf, n, *IV, &params->key, 0, params->threads);
+  cipher_aux_fwrite(buf, 64, n, &params->output);
+  stream_flush(params);
+  *IV += n;
+}
+static void encode_stream(mode_params_t * params) {
+  uint32_t IV = cipher_put_header("KC3STR", params);
+  stream_flush(params);
+  size_t batch = engine_blocks(params), cap = 63 * batch, have = 0;
+  size_t threshold = params->flush_bytes && params->flush_bytes < cap
+    ? params->flush_bytes : cap;
+  gf * buf = malloc(64 * batch);
+  if (!buf) eprintf("Out of memory.\n");
+  // The input is read past stdio, which may have buffered ahead.
+  int fd = fileno(params->input.file);
+  long start = ftell(params->input.file);
+  if (start >= 0) lseek(fd, start, SEEK_SET);
+  int64_t since = 0;  uint32_t processed = 0; // The FILE does not advance.
+  for (;;) {
+    int timeout = -1;
+    if (have) {
+      int64_t left = since + params->flush_ms - stream_clock();
+      timeout = left > 0 ? left : 0;
+    }
+    struct pollfd p = { .fd = fd, .events = POLLIN };
+    int ready = poll(&p, 1, timeout);
+    if (ready < 0 && errno != EINTR)
+      eprintf("Could not poll the input: %s\n", strerror(errno));
+    if (ready <= 0) {
+      if (ready == 0) // The deadline has passed.
+        stream_emit(params, buf, have, &IV, 0), have = 0;
+      continue;
+    }
+    ssize_t n = read(fd, buf + have, cap - have);
+    if (n < 0 && errno != EINTR && errno != EAGAIN)
+      eprintf("Could not read from the input file: %s\n", strerror(errno));
+    if (n == 0) break;
+    if (n < 0) continue;
+    if (!have) since = stream_clock();
+    processed += n;
+    if ((have += n) >= threshold) {
+      // Whole blocks only, unless the threshold is below a block; the
+      // remainder waits for more data or the deadline.
+      size_t len = have >= 63 ? have - have % 63 : have;
+      gf rest[63];  memcpy(rest, buf + len, have - len);
+      stream_emit(params, buf, len, &IV, 0);
+      memcpy(buf, rest, have -= len);
+      since = stream_clock();
+    }
+    if (params->pcb) params->pcb(processed, params->input.max);
+  }
+  stream_emit(params, buf, have, &IV, 1);
+  free(buf);
+}
+#endif
+static void decode_stream(mode_params_t * params) {
+  uint32_t IV = cipher_check_header(params);
+  size_t batch = engine_blocks(params);
+  uint64_t pos = 0;
+  gf * buf = malloc(64 * batch);
+  if (!buf) eprintf("Out of memory.\n");
+  for (int done = 0; !done; ) {
+    size_t n = 0;
+    while (cipher_aux_fread(buf + 64 * n, 64, 1, &params->input) == 1
+        && ++n < batch && stream_ready(&params->input));
+    if (n == 0)
+      eprintf("Truncated input.\n");
+    engine_run(buf, n, IV, &params->key, 1, params->threads);
+    for (size_t i = 0; i < n && !done; i++) {
+      gf * out = buf + 64 * i;  int len = out[63] & 0x7f;
+      if (len == 63 && out[63] & 0x80)
+        eprintf("Wrong key or corrupted input.\n");
+      cipher_check_block(out, 64, len);
+      done = cipher_range_fwrite(out, len, &pos, params);
+      if (!done && out[63] & 0x80)
+        cipher_check_end(params, n - 1 - i), done = 1;
+    }
+    stream_flush(params);
+    IV += n;
+  }
+  free(buf);
+}
+
+// ---------------------------------------------------------------------------
+//      Sector images, encoded sector by sector over the threads.
+// ---------------------------------------------------------------------------
+typedef struct {
+  block_key_t * key;
+  gf * buf;
+  uint64_t sector;
+  size_t size, len;
+  int decode;
+} sector_job_t;
+static void * sector_worker(void * arg) {
+  sector_job_t * job = arg;
+  for (size_t off = 0; off < job->len; off += job->size) {
+    size_t n = job->len - off < job->size ? job->len - off : job->size;
+    sector_run(job->key, job->sector++, job->buf + off, n, job->decode);
+  }
+  return NULL;
+}
+static void sector_image(mode_params_t * params, int decode) {
+  int threads = params->threads > 1 ? params->threads : 1;
+  size_t size = params->sector, per = engine_blocks(params) * 64 / size;
+  if (per < (size_t) threads) per = threads;
+  gf * buf = malloc(per * size);
+  if (!buf) eprintf("Out of memory.\n");
+  block_key_t base;  sector_base(&params->key, &base);
+  uint64_t sector = 0;
+  for (size_t len = per * size; len == per * size; ) {
+    len = cipher_aux_fread(buf, 1, per * size, &params->input);
+    if (len % 64)
+      eprintf("Input size is not a multiple of 64 bytes.\n");
+    size_t n = (len + size - 1) / size;
+    sector_job_t job[threads];
+    for (int t = 0; t < threads; t++) {
+      size_t lo = n * t / threads, hi = n * (t + 1) / threads;
+      job[t] = (sector_job_t) {
+        &base, buf + lo * size, sector + lo, size,
+        (hi * size < len ? hi * size : len) - lo * size, decode
+      };
+    }
+    run_jobs(sector_worker, job, sizeof(job[0]), threads);
+    if (params->pcb)
+      params->pcb(cipher_aux_ftell(&params->input), params->input.max);
+    cipher_aux_fwrite(buf, 1, len, &params->output);
+    sector += n;
+  }
+  free(buf);
+}
+static void encode_sectors(mode_params_t * params) {
+  sector_image(params, 0);
+}
+static void decode_sectors(mode_params_t * params) {
+  sector_image(params, 1);
+}
+
+// ---------------------------------------------------------------------------
+//      Re-keying. The decoder and the encoder are connected by an in-memory
+//      channel and run concurrently, so that the plaintext never reaches
+//      the disk and the two passes overlap. Without thread support, the
+//      channel grows to hold the entire plaintext instead.
+// ---------------------------------------------------------------------------
+#define CHANNEL_SIZE (1 << 20)
+typedef struct {
+  gf * buf;
+  size_t cap, rd, wr;
+  uint32_t processed;
+  int closed;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#endif
+} channel_t;
+static size_t channel_write(const void * ptr, size_t size,
+    size_t nmemb, void * stream) {
+  channel_t * ch = stream;  const gf * src = ptr;  size_t len = size * nmemb;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&ch->lock);
+#endif
+  while (len > 0) {
+    if (ch->wr == ch->cap && ch->rd > 0) {
+      memmove(ch->buf, ch->buf + ch->rd, ch->wr - ch->rd);
+      ch->wr -= ch->rd;  ch->rd = 0;
+    }
+    if (ch->wr == ch->cap) {
+#ifdef HAVE_PTHREAD_H
+      pthread_cond_wait(&ch->cond, &ch->lock);
+      continue;
+#else
+      if (!(ch->buf = realloc(ch->buf, ch->cap *= 2)))
+        eprintf("Out of memory.\n");
+#endif
+    }
+    size_t n = ch->cap - ch->wr < len ? ch->cap - ch->wr : len;
+    memcpy(ch->buf + ch->wr, src, n);
+    ch->wr += n;  src += n;  len -= n;
+#ifdef HAVE_PTHREAD_H
+    pthread_cond_broadcast(&ch->cond);
+#endif
+  }
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&ch->lock);
+#endif
+  return nmemb;
+}
+static size_t channel_read(void * ptr, size_t size,
+    size_t nmemb, void * stream) {
+  channel_t * ch = stream;  gf * dst = ptr;  size_t len = size * nmemb;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&ch->lock);
+#endif
+  while (len > 0) {
+    if (ch->rd == ch->wr) {
+      if (ch->closed) break;
+#ifdef HAVE_PTHREAD_H
+      pthread_cond_wait(&ch->cond, &ch->lock);
+#endif
+      continue;
+    }
+    size_t n = ch->wr - ch->rd < len ? ch->wr - ch->rd : len;
+    memcpy(dst, ch->buf + ch->rd, n);
+    ch->rd += n;  ch->processed += n;  dst += n;  len -= n;
+#ifdef HAVE_PTHREAD_H
+    pthread_cond_broadcast(&ch->cond);
+#endif
+  }
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&ch->lock);
+#endif
+  return (dst - (gf *) ptr) / size;
+}
+static uint32_t channel_tell(void * stream) {
+  return ((channel_t *) stream)->processed;
+}
+
+typedef struct {
+  stream_dec dec;
+  mode_params_t * params;
+  channel_t * ch;
+} rekey_job_t;
+static void * rekey_worker(void * arg) {
+  rekey_job_t * job = arg;
+  job->dec(job->params);
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&job->ch->lock);
+#endif
+  job->ch->closed = 1;
+#ifdef HAVE_PTHREAD_H
+  pthread_cond_broadcast(&job->ch->cond);
+  pthread_mutex_unlock(&job->ch->lock);
+#endif
+  return NULL;
+}
+static void rekey(stream_dec dec, mode_params_t * from,
+    stream_enc enc, mode_params_t * to) {
+  channel_t ch = { .buf = malloc(CHANNEL_SIZE), .cap = CHANNEL_SIZE };
+  if (!ch.buf) eprintf("Out of memory.\n");
+  from->output = (cipher_aux_t) {
+    .type = CIPHER_STREAM_FUNCTION,
+    .stream = { NULL, channel_write, channel_tell, &ch }
+  };
+  to->input = (cipher_aux_t) {
+    .type = CIPHER_STREAM_FUNCTION,
+    .stream = { channel_read, NULL, channel_tell, &ch }
+  };
+  rekey_job_t job = { dec, from, &ch };
+#ifdef HAVE_PTHREAD_H
+  pthread_t tid;
+  pthread_mutex_init(&ch.lock, NULL);
+  pthread_cond_init(&ch.cond, NULL);
+  if (pthread_create(&tid, NULL, rekey_worker, &job) != 0)
+    eprintf("Could not create a thread.\n");
+  enc(to);
+  pthread_join(tid, NULL);
+  pthread_cond_destroy(&ch.cond);
+  pthread_mutex_destroy(&ch.lock);
+#else
+  rekey_worker(&job);
+  enc(to);
+#endif
+  free(ch.buf);
+}
+
+// ---------------------------------------------------------------------------
+//      Incremental mode. The plaintext is split into content-defined chunks
+//      (cut where a keyed gear hash of the preceding bytes has its low 16
+//      bits clear, between 16KiB and 256KiB), each of which is encoded as a
+//      self-contained KC3CTR record. A record is preceded by a fingerprint
+//      of the chunk and the record length. The fingerprint is a fast keyed
+//      hash of the plaintext, encoded with the block cipher so that it does
+//      not reveal the hash. When re-encoding, a chunk whose fingerprint is
+//      found in the previous output is copied from there verbatim, so only
+//      the chunks that changed are encoded again.
+// ---------------------------------------------------------------------------
+#define INC_MIN (16 << 10)
+#define INC_MAX (256 << 10)
+#define INC_MASK 0xffff
+typedef struct {
+  uint64_t seed[2], gear[256];
+  block_key_t fk;
+} inc_keys_t;
+typedef struct {
+  gf fp[16];
+  long off;
+  uint32_t len;
+} inc_entry_t;
+static uint64_t splitmix64(uint64_t * x) {
+  uint64_t z = (*x += 0x9e3779b97f4a7c15u);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+  return z ^ (z >> 31);
+}
+static void inc_derive(block_key_t * key, inc_keys_t * ik) {
+  gf seed[24];  uint64_t x;
+  derive_key(key, "incremental seed", seed, sizeof(seed));
+  derive_key(key, "incremental fingerprint", (gf *) &ik->fk, sizeof(ik->fk));
+  memcpy(ik->seed, seed, 16);  memcpy(&x, seed + 16, 8);
+  for (int i = 0; i < 256; i++) ik->gear[i] = splitmix64(&x);
+}
+static size_t inc_cut(inc_keys_t * ik, gf * buf, size_t len) {
+  if (len <= INC_MIN) return len;
+  uint64_t h = 0;
+  for (size_t i = INC_MIN - 64; i < len; i++) {
+    h = (h << 1) + ik->gear[buf[i]];
+    if (i >= INC_MIN && !(h & INC_MASK)) return i + 1;
+  }
+  return len;
+}
+static void inc_fingerprint(inc_keys_t * ik, gf * buf, size_t len,
+    gf fp[16]) {
+  uint64_t h[2] = { ik->seed[0], ik->seed[1] ^ len }, w;
+  gf blk[64] = { 0 }, out[64];
+  for (size_t i = 0; i < len; i += 8) {
+    size_t n = len - i < 8 ? len - i : 8;  w = 0;
+    memcpy(&w, buf + i, n);
+    h[0] = (h[0] ^ w) * 0x9fb21c651e98df25u;  h[0] ^= h[0] >> 29;
+    h[1] = (h[1] + w) * 0xc2b2ae3d27d4eb4fu;  h[1] ^= h[1] >> 31;
+  }
+  block_key_t k = ik->fk;
+  memcpy(blk, h, 16);
+  encode_block(blk, out, 0, &k);
+  memcpy(fp, out, 16);
+}
+static int inc_compare(const void * a, const void * b) {
+  return memcmp(a, b, 16);
+}
+static inc_entry_t * inc_index(FILE * f, size_t * n) {
+  size_t cap = 0;  inc_entry_t * idx = NULL;  gf hdr[20];  char tag[6];
+  *n = 0;
+  if (!f) return NULL;
+  if (fread(tag, 1, 6, f) != 6 || memcmp(tag, "KC3INC", 6))
+    eprintf("The previous output is not an incremental stream.\n");
+  while (fread(hdr, 1, 20, f) == 20) {
+    if (*n == cap && !(idx = realloc(idx, (cap = cap * 2 + 64) * sizeof(*idx))))
+      eprintf("Out of memory.\n");
+    memcpy(idx[*n].fp, hdr, 16);
+    read32_le_buf(&idx[*n].len, hdr + 16);
+    idx[*n].off = ftell(f);
+    if (fseek(f, idx[(*n)++].len, SEEK_CUR) != 0)
+      eprintf("Could not seek in the previous output: %s\n", strerror(errno));
+  }
+  qsort(idx, *n, sizeof(*idx), inc_compare);
+  return idx;
+}
+static void encode_inc(mode_params_t * params) {
+  inc_keys_t ik;  size_t n, have = 0, reused = 0, total = 0;
+  inc_derive(&params->key, &ik);
+  inc_entry_t * idx = inc_index(params->previous, &n);
+  gf * buf = malloc(INC_MAX), * rec = malloc(record_size(INC_MAX)), hdr[20];
+  if (!buf || !rec) eprintf("Out of memory.\n");
+  cipher_aux_fwrite("KC3INC", 1, 6, &params->output);
+  for (;;) {
+    have += cipher_aux_fread(buf + have, 1, INC_MAX - have, &params->input);
+    if (have == 0) break;
+    size_t len = inc_cut(&ik, buf, have);  uint32_t rlen;
+    inc_fingerprint(&ik, buf, len, hdr);
+    inc_entry_t * e = idx ? bsearch(hdr, idx, n, sizeof(*idx), inc_compare) : NULL;
+    if (e) {
+      rlen = e->len;
+      if (rlen > record_size(INC_MAX)
+          || fseek(params->previous, e->off, SEEK_SET) != 0
+          || fread(rec, 1, rlen, params->previous) != rlen)
+        eprintf("Could not read from the previous output.\n");
+      reused++;
+    } else {
+      mode_params_t rp = {
+        .key = params->key, .threads = params->threads, .batch = params->batch,
+        .input = { .type = CIPHER_STREAM_BLOCK, .buffer = buf, .size = len },
+        .output = {
+          .type = CIPHER_STREAM_BLOCK, .buffer = rec,
+          .size = rlen = record_size(len)
+        }
+      };
+      gf in[64] = { 0 };
+      uint32_t IV = cipher_put_header("KC3CTR", &rp);
+      encode_ctr_from(&rp, IV, in, 0);
+    }
+    write32_le_buf(rlen, hdr + 16);
+    cipher_aux_fwrite(hdr, 1, 20, &params->output);
+    cipher_aux_fwrite(rec, 1, rlen, &params->output);
+    memmove(buf, buf + len, have -= len);
+    total++;
+    if (params->pcb)
+      params->pcb(cipher_aux_ftell(&params->input), params->input.max);
+  }
   if (params->pcb)
-    params->pcb(cipher_aux_ftell(&params->input), params->input.max);
-  cipher_aux_fwrite(out, 1, read = out[63], &params->output);
-  IV++;
-  while (read == 63) {
-    if (cipher_aux_fread(in, 1, 64, &params->input) != 64)
+    fprintf(stderr, "\rReused %zu of %zu chunks.\n", reused, total);
+  free(idx);  free(buf);  free(rec);
+}
+static void decode_inc(mode_params_t * params) {
+  gf * rec = malloc(record_size(INC_MAX)), hdr[20];  size_t n;
+  if (!rec) eprintf("Out of memory.\n");
+  if (params->range_end)
+    eprintf("Ranges are not supported for incremental input.\n");
+  while ((n = cipher_aux_fread(hdr, 1, 20, &params->input)) == 20) {
+    uint32_t rlen;  read32_le_buf(&rlen, hdr + 16);
+    if (rlen < 10 || rlen > record_size(INC_MAX))
+      eprintf("Input corrupted.\n");
+    if (cipher_aux_fread(rec, 1, rlen, &params->input) != rlen)
       eprintf("Truncated input.\n");
-    decode_block(in, out, IV, &params->key);
+    if (memcmp(rec, "KC3CTR", 6))
+      eprintf("Input corrupted: unknown mode of operation.\n");
+    mode_params_t rp = *params;
+    rp.input = (cipher_aux_t) {
+      .type = CIPHER_STREAM_BLOCK, .buffer = rec, .size = rlen, .consumed = 6
+    };
+    rp.pcb = NULL;
+    decode_ctr(&rp);
     if (params->pcb)
       params->pcb(cipher_aux_ftell(&params->input), params->input.max);
-    for (int i = 0; i < 64; i++) out[i] ^= prev_in[i];
-    cipher_aux_fwrite(out, 1, read = out[63], &params->output);
-    IV++;
-    memcpy(prev_in, in, 64);
   }
+  if (n != 0) eprintf("Truncated input.\n");
+  free(rec);
+}
+
+// ---------------------------------------------------------------------------
+//      Optional compression of the plaintext. The input is cut into chunks
+//      of 64KiB which are compressed independently with a byte-oriented
+//      LZ77 variant: each sequence is a token holding the literal count and
+//      the match length (minus 4) in its nibbles, extended by 255-runs,
+//      followed by the literals and a 16-bit match offset. The last
+//      sequence of a chunk carries literals only. Every chunk is preceded
+//      by its uncompressed and compressed length; chunks that do not shrink
+//      are stored verbatim. Compression is several orders of magnitude
+//      faster than the cipher, hence it is simply interleaved with it by
+//      means of function streams.
+// ---------------------------------------------------------------------------
+#define LZ_CHUNK 65536
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+typedef struct {
+  FILE * file;
+  uint32_t processed;
+  size_t len, pos;
+  uint32_t table[1 << LZ_HASH_BITS];
+  gf raw[LZ_CHUNK], frame[8 + LZ_CHUNK + LZ_CHUNK / 255 + 16];
+} lz_stream_t;
+static uint32_t lz_read32(const gf * p) {
+  uint32_t v; memcpy(&v, p, 4); return v;
+}
+static gf * lz_put_len(gf * op, size_t len) {
+  for (; len >= 255; len -= 255) *op++ = 255;
+  *op++ = len;  return op;
+}
+static size_t lz_compress(const gf * src, size_t n, gf * dst,
+    uint32_t table[1 << LZ_HASH_BITS]) {
+  memset(table, 0, sizeof(uint32_t) << LZ_HASH_BITS);
+  size_t anchor = 0, i = 0;  gf * op = dst;
+  while (i + LZ_MIN_MATCH <= n) {
+    uint32_t seq = lz_read32(src + i);
+    uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+    size_t cand = table[h];  table[h] = i + 1;
+    if (!cand-- || i - cand > 65535 || lz_read32(src + cand) != seq)
+      { i++; continue; }
+    size_t mlen = LZ_MIN_MATCH, lit = i - anchor;
+    while (i + mlen < n && src[cand + mlen] == src[i + mlen]) mlen++;
+    *op++ = (lit < 15 ? lit : 15) << 4
+          | (mlen - LZ_MIN_MATCH < 15 ? mlen - LZ_MIN_MATCH : 15);
+    if (lit >= 15) op = lz_put_len(op, lit - 15);
+    memcpy(op, src + anchor, lit);  op += lit;
+    *op++ = (i - cand) & 0xff;  *op++ = (i - cand) >> 8;
+    if (mlen - LZ_MIN_MATCH >= 15)
+      op = lz_put_len(op, mlen - LZ_MIN_MATCH - 15);
+    anchor = i += mlen;
+  }
+  size_t lit = n - anchor;
+  *op++ = (lit < 15 ? lit : 15) << 4;
+  if (lit >= 15) op = lz_put_len(op, lit - 15);
+  memcpy(op, src + anchor, lit);  op += lit;
+  return op - dst;
+}
+static size_t lz_get_len(const gf ** ip, const gf * iend, size_t len) {
+  if (len < 15) return len;
+  for (gf b = 255; b == 255; len += b) {
+    if (*ip >= iend) eprintf("Input corrupted.\n");
+    b = *(*ip)++;
+  }
+  return len;
+}
+static void lz_decompress(const gf * src, size_t n, gf * dst, size_t dn) {
+  const gf * ip = src, * iend = src + n;  gf * op = dst, * oend = dst + dn;
+  for (;;) {
+    if (ip >= iend) eprintf("Input corrupted.\n");
+    gf token = *ip++;
+    size_t lit = lz_get_len(&ip, iend, token >> 4);
+    if (lit > (size_t) (iend - ip) || lit > (size_t) (oend - op))
+      eprintf("Input corrupted.\n");
+    memcpy(op, ip, lit);  ip += lit;  op += lit;
+    if (ip == iend) break;
+    if (iend - ip < 2) eprintf("Input corrupted.\n");
+    size_t off = ip[0] | ip[1] << 8;  ip += 2;
+    size_t mlen = lz_get_len(&ip, iend, token & 15) + LZ_MIN_MATCH;
+    if (!off || off > (size_t) (op - dst) || mlen > (size_t) (oend - op))
+      eprintf("Input corrupted.\n");
+    for (gf * m = op - off; mlen--; ) *op++ = *m++;
+  }
+  if (op != oend) eprintf("Input corrupted.\n");
+}
+static lz_stream_t * lz_open(FILE * file) {
+  lz_stream_t * lz = malloc(sizeof(lz_stream_t));
+  if (!lz) eprintf("Out of memory.\n");
+  lz->file = file;  lz->processed = lz->len = lz->pos = 0;
+  return lz;
+}
+static void lz_close(lz_stream_t * lz) {
+  if (lz->pos != 0) eprintf("Truncated input.\n");
+  free(lz);
+}
+static size_t lz_read(void * ptr, size_t size, size_t nmemb, void * stream) {
+  lz_stream_t * lz = stream;  gf * dst = ptr;  size_t want = size * nmemb;
+  while (want > 0) {
+    if (lz->pos == lz->len) {
+      size_t n = fread(lz->raw, 1, LZ_CHUNK, lz->file);
+      if (ferror(lz->file))
+        eprintf("Could not read from the input file: %s\n", strerror(errno));
+      if (n == 0) { lz->pos = lz->len = 0; break; }
+      size_t c = lz_compress(lz->raw, n, lz->frame + 8, lz->table);
+      if (c >= n) memcpy(lz->frame + 8, lz->raw, c = n);
+      write32_le_buf(n, lz->frame);  write32_le_buf(c, lz->frame + 4);
+      lz->processed += n;  lz->len = c + 8;  lz->pos = 0;
+    }
+    size_t n = lz->len - lz->pos < want ? lz->len - lz->pos : want;
+    memcpy(dst, lz->frame + lz->pos, n);
+    dst += n;  lz->pos += n;  want -= n;
+  }
+  return (dst - (gf *) ptr) / size;
+}
+static size_t lz_write(const void * ptr, size_t size,
+    size_t nmemb, void * stream) {
+  lz_stream_t * lz = stream;  const gf * src = ptr;
+  size_t have = size * nmemb;
+  while (have > 0) {
+    size_t need = lz->pos < 8 ? 8 : lz->len + 8;
+    size_t n = need - lz->pos < have ? need - lz->pos : have;
+    memcpy(lz->frame + lz->pos, src, n);
+    src += n;  lz->pos += n;  have -= n;
+    if (lz->pos == 8) {
+      uint32_t raw, comp;
+      read32_le_buf(&raw, lz->frame);  read32_le_buf(&comp, lz->frame + 4);
+      if (raw == 0 || raw > LZ_CHUNK || comp == 0 || comp > raw)
+        eprintf("Input corrupted.\n");
+      lz->len = comp;
+    }
+    if (lz->pos > 8 && lz->pos == lz->len + 8) {
+      uint32_t raw;  read32_le_buf(&raw, lz->frame);
+      if (lz->len == raw) memcpy(lz->raw, lz->frame + 8, raw);
+      else lz_decompress(lz->frame + 8, lz->len, lz->raw, raw);
+      if (fwrite(lz->raw, 1, raw, lz->file) != raw)
+        eprintf("Could not write to the output file: %s\n", strerror(errno));
+      lz->processed += raw;  lz->pos = 0;
+    }
+  }
+  return nmemb;
+}
+static uint32_t lz_tell(void * stream) {
+  return ((lz_stream_t *) stream)->processed;
+}
+
+// ---------------------------------------------------------------------------
+//      Striping. The ciphertext is cut into chunks of 1MiB that are
+//      distributed round-robin over a number of shard files, each of which
+//      is written (or, when decoding, read ahead) by its own I/O thread.
+//      The output file proper receives a manifest listing the shards:
+//      "KC3SHD", the chunk size and count on one line, then the shard paths
+//      one per line. A manifest may ask for at most STRIPE_CHUNK bytes per
+//      chunk and STRIPE_MAX shards.
+// ---------------------------------------------------------------------------
+#define STRIPE_CHUNK (1 << 20)
+#define STRIPE_MAX 64
+typedef struct {
+  FILE * file;
+  gf * buf;
+  size_t len;
+  int full, stop, reading;
+#ifdef HAVE_PTHREAD_H
+  pthread_t tid;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#endif
+} shard_t;
+typedef struct {
+  shard_t * shard;
+  int n;
+  size_t chunk, pos, len;
+  gf * cur;
+  uint64_t index;
+  uint32_t processed;
+} stripe_t;
+static void shard_io(shard_t * sh, size_t chunk) {
+  if (sh->reading) {
+    sh->len = fread(sh->buf, 1, chunk, sh->file);
+    if (ferror(sh->file))
+      eprintf("Could not read from a shard: %s\n", strerror(errno));
+  } else if (fwrite(sh->buf, 1, sh->len, sh->file) != sh->len)
+    eprintf("Could not write to a shard: %s\n", strerror(errno));
+}
+#ifdef HAVE_PTHREAD_H
+typedef struct { shard_t * sh; size_t chunk; } shard_job_t;
+static void * shard_worker(void * arg) {
+  shard_t * sh = ((shard_job_t *) arg)->sh;
+  size_t chunk = ((shard_job_t *) arg)->chunk;  free(arg);
+  pthread_mutex_lock(&sh->lock);
+  for (;;) {
+    // Writers wait for a chunk to write, readers for room to read into.
+    while (sh->full == sh->reading && !sh->stop)
+      pthread_cond_wait(&sh->cond, &sh->lock);
+    if (sh->full == sh->reading || (sh->stop && sh->reading)) break;
+    pthread_mutex_unlock(&sh->lock);
+    shard_io(sh, chunk);
+    pthread_mutex_lock(&sh->lock);
+    sh->full = !sh->full;
+    pthread_cond_broadcast(&sh->cond);
+    if (sh->reading && sh->len < chunk) break;
+  }
+  pthread_mutex_unlock(&sh->lock);
+  return NULL;
+}
+#endif
+// Exchange the current buffer with the next shard in turn: a full chunk is
+// handed over for writing, or a chunk that has been read ahead is taken.
+static void stripe_swap(stripe_t * st) {
+  shard_t * sh = &st->shard[st->index++ % st->n];
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&sh->lock);
+  while (sh->full != sh->reading)
+    pthread_cond_wait(&sh->cond, &sh->lock);
+#else
+  if (sh->reading) shard_io(sh, st->chunk);
+#endif
+  gf * t = sh->buf;  sh->buf = st->cur;  st->cur = t;
+  size_t len = sh->len;  sh->len = st->pos;  st->len = len;  st->pos = 0;
+#ifdef HAVE_PTHREAD_H
+  sh->full = !sh->full;
+  pthread_cond_broadcast(&sh->cond);
+  pthread_mutex_unlock(&sh->lock);
+#else
+  if (!sh->reading) shard_io(sh, st->chunk);
+#endif
+}
+static stripe_t * stripe_open(char ** path, int n, size_t chunk, int reading) {
+  stripe_t * st = calloc(1, sizeof(stripe_t));
+  if (!st || !(st->shard = calloc(n, sizeof(shard_t)))
+      || !(st->cur = malloc(chunk)))
+    eprintf("Out of memory.\n");
+  st->n = n;  st->chunk = chunk;
+  for (int i = 0; i < n; i++) {
+    shard_t * sh = &st->shard[i];
+    if (!(sh->file = fopen(path[i], reading ? "rb" : "wb")))
+      eprintf("Could not open `%s': %s\n", path[i], strerror(errno));
+    if (!(sh->buf = malloc(chunk))) eprintf("Out of memory.\n");
+    sh->reading = reading;
+#ifdef HAVE_PTHREAD_H
+    shard_job_t * job = malloc(sizeof(shard_job_t));
+    if (!job) eprintf("Out of memory.\n");
+    *job = (shard_job_t) { sh, chunk };
+    pthread_mutex_init(&sh->lock, NULL);
+    pthread_cond_init(&sh->cond, NULL);
+    if (pthread_create(&sh->tid, NULL, shard_worker, job) != 0)
+      eprintf("Could not create a thread.\n");
+#endif
+  }
+  return st;
+}
+static void stripe_close(stripe_t * st) {
+  if (!st->shard[0].reading && st->pos > 0)
+    stripe_swap(st);
+  for (int i = 0; i < st->n; i++) {
+    shard_t * sh = &st->shard[i];
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&sh->lock);
+    sh->stop = 1;
+    pthread_cond_broadcast(&sh->cond);
+    pthread_mutex_unlock(&sh->lock);
+    pthread_join(sh->tid, NULL);
+    pthread_cond_destroy(&sh->cond);
+    pthread_mutex_destroy(&sh->lock);
+#endif
+    if (fclose(sh->file) != 0)
+      eprintf("Could not close a shard: %s\n", strerror(errno));
+    free(sh->buf);
+  }
+  free(st->shard);  free(st->cur);  free(st);
+}
+static size_t stripe_write(const void * ptr, size_t size,
+    size_t nmemb, void * stream) {
+  stripe_t * st = stream;  const gf * src = ptr;  size_t len = size * nmemb;
+  while (len > 0) {
+    size_t n = st->chunk - st->pos < len ? st->chunk - st->pos : len;
+    memcpy(st->cur + st->pos, src, n);
+    st->pos += n;  src += n;  len -= n;  st->processed += n;
+    if (st->pos == st->chunk) stripe_swap(st);
+  }
+  return nmemb;
+}
+static size_t stripe_read(void * ptr, size_t size,
+    size_t nmemb, void * stream) {
+  stripe_t * st = stream;  gf * dst = ptr;  size_t len = size * nmemb;
+  while (len > 0) {
+    if (st->pos == st->len) {
+      if (st->index > 0 && st->len < st->chunk) break;
+      stripe_swap(st);
+      continue;
+    }
+    size_t n = st->len - st->pos < len ? st->len - st->pos : len;
+    memcpy(dst, st->cur + st->pos, n);
+    st->pos += n;  dst += n;  len -= n;  st->processed += n;
+  }
+  return (dst - (gf *) ptr) / size;
+}
+static uint32_t stripe_tell(void * stream) {
+  return ((stripe_t *) stream)->processed;
+}
+// Relative shard paths are taken from the directory of the manifest, so
+// that the files can be moved together. A NULL manifest is the standard
+// input or output, with the shards in the working directory.
+static char * shard_path(const char * manifest, const char * path) {
+  const char * sep = manifest ? strrchr(manifest, '/') : NULL;
+#ifdef _WIN32
+  const char * bs = manifest ? strrchr(manifest, '\\') : NULL;
+  if (bs && (!sep || bs > sep)) sep = bs;
+  int absolute = *path == '/' || *path == '\\' || (*path && path[1] == ':');
+#else
+  int absolute = *path == '/';
+#endif
+  size_t dir = sep && !absolute ? sep - manifest + 1 : 0;
+  char * full = malloc(dir + strlen(path) + 1);
+  if (!full) eprintf("Out of memory.\n");
+  memcpy(full, manifest, dir);  strcpy(full + dir, path);
+  return full;
+}
+// Fails if any of the shards would overwrite an existing file.
+static void stripe_check(const char * paths, const char * manifest_path) {
+  char * list = strdup(paths);
+  if (!list) eprintf("Out of memory.\n");
+  for (char * p = strtok(list, ","); p; p = strtok(NULL, ",")) {
+    char * full = shard_path(manifest_path, p);
+    if (access(full, F_OK) == 0)
+      eprintf("File `%s' already exists. Use `-f' to overwrite.\n", full);
+    free(full);
+  }
+  free(list);
+}
+static cipher_aux_t stripe_create(char * paths, FILE * manifest,
+    const char * manifest_path) {
+  int n = 1;
+  for (char * p = paths; *p; p++) n += *p == ',';
+  char * path[n];  path[0] = strtok(paths, ",");
+  for (int i = 1; i < n; i++) path[i] = strtok(NULL, ",");
+  for (int i = 0; i < n; i++)
+    if (!path[i]) eprintf("Empty shard path.\n");
+  if (n > STRIPE_MAX)
+    eprintf("At most %d shards are supported.\n", STRIPE_MAX);
+  char * full[n];
+  for (int i = 0; i < n; i++) full[i] = shard_path(manifest_path, path[i]);
+  fprintf(manifest, "KC3SHD%u %d\n", STRIPE_CHUNK, n);
+  for (int i = 0; i < n; i++) fprintf(manifest, "%s\n", path[i]);
+  stripe_t * st = stripe_open(full, n, STRIPE_CHUNK, 0);
+  for (int i = 0; i < n; i++) free(full[i]);
+  return (cipher_aux_t) {
+    .type = CIPHER_STREAM_FUNCTION,
+    .stream = { NULL, stripe_write, stripe_tell, st }
+  };
+}
+// Reads the rest of a manifest, the tag having been consumed already.
+static cipher_aux_t stripe_load(FILE * manifest, const char * manifest_path) {
+  unsigned chunk;  int n;  char buf[4096];
+  if (fscanf(manifest, "%u %d\n", &chunk, &n) != 2 || n < 1
+      || n > STRIPE_MAX || chunk < 1 || chunk > STRIPE_CHUNK)
+    eprintf("Input corrupted: invalid manifest.\n");
+  char * path[n];
+  for (int i = 0; i < n; i++) {
+    if (!fgets(buf, sizeof(buf), manifest) || !strchr(buf, '\n'))
+      eprintf("Input corrupted: invalid manifest.\n");
+    *strchr(buf, '\n') = 0;
+    path[i] = shard_path(manifest_path, buf);
+  }
+  stripe_t * st = stripe_open(path, n, chunk, 1);
+  for (int i = 0; i < n; i++) free(path[i]);
+  return (cipher_aux_t) {
+    .type = CIPHER_STREAM_FUNCTION,
+    .stream = { stripe_read, NULL, stripe_tell, st }
+  };
 }
 
 // ---------------------------------------------------------------------------
 //      Command-line stub.
 // ---------------------------------------------------------------------------
-enum { MODE_ENCODE, MODE_DECODE, MODE_KEYGEN, MODE_RANDOM };
+enum {
+  MODE_ENCODE, MODE_DECODE, MODE_KEYGEN, MODE_RANDOM, MODE_TUNE, MODE_REKEY
+};
+enum {
+  OPT_RANGE = 256, OPT_APPEND, OPT_TUNE, OPT_BATCH, OPT_REKEY, OPT_SECTOR,
+  OPT_KERNEL, OPT_STRIPE, OPT_INCREMENTAL, OPT_STREAM
+};
 
 static uint32_t file_size(FILE * f) {
-  fseek(f, 0, SEEK_END);
-  uint32_t size = ftell(f);
-  fseek(f, 0, SEEK_SET);
-  return size;
+  long pos = ftell(f), size;
+  // Pipes and terminals can not be seeked, so their size is unknown.
+  if (pos < 0 || fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0)
+    return 0;
+  fseek(f, pos, SEEK_SET);
+  return size - pos;
 }
 
-static void detect_mode_of_operation(FILE * ciphertext,
-    stream_enc * e, stream_dec * d) {
+// Returns whether the plaintext has been compressed before encoding.
+// A striped stream is detected by its manifest, which is replaced with the
+// reassembled stream; `path' names the file holding it, or is NULL.
+static int detect_mode_of_operation(cipher_aux_t * ciphertext,
+    const char * path, stream_enc * e, stream_dec * d, stream_enc * a) {
   char hdr[6];
-  if (fread(hdr, 1, 6, ciphertext) != 6)
+  if (cipher_aux_fread(hdr, 1, 6, ciphertext) != 6)
     eprintf("Truncated input.\n");
-  if (!memcmp(hdr, "KC3CTR", 6))      *e = encode_ctr, *d = decode_ctr;
-  else if (!memcmp(hdr, "KC3OFB", 6)) *e = encode_ofb, *d = decode_ofb;
+  if (!memcmp(hdr, "KC3SHD", 6) && ciphertext->type == CIPHER_STREAM_FILE) {
+    *ciphertext = stripe_load(ciphertext->file, path);
+    return detect_mode_of_operation(ciphertext, path, e, d, a);
+  }
+  int z = hdr[5] == 'Z';
+  if (!memcmp(hdr, z ? "KC3CTZ" : "KC3CTR", 6))
+    *e = encode_ctr, *d = decode_ctr, *a = append_ctr;
+  else if (!memcmp(hdr, z ? "KC3OFZ" : "KC3OFB", 6))
+    *e = encode_ofb, *d = decode_ofb, *a = append_ofb;
+  else if (!memcmp(hdr, z ? "KC3CWZ" : "KC3CWB", 6))
+    *e = encode_ctr128, *d = decode_ctr128, *a = NULL;
+  else if (!memcmp(hdr, "KC3STR", 6)) // Re-encoded as a regular stream.
+    *e = encode_ctr, *d = decode_stream, *a = NULL;
+  else if (!memcmp(hdr, "KC3INC", 6))
+    *e = encode_inc, *d = decode_inc, *a = NULL;
   else eprintf("Input corrupted: unknown mode of operation.\n");
+  return z;
 }
 
 static void help(void) {
@@ -379,15 +2052,28 @@ static void help(void) {
     "  -d, --decode        Decode the input file.\n"
     "  -g, --keygen        Generate a new key file.\n"
     "  -r, --random        Generate random data using the key.\n"
+    "      --tune          Find and save the fastest engine settings.\n"
+    "      --rekey=key     Re-encode the input file under a new key.\n"
     "General options:\n"
     "  -v, --version       Print the version information.\n"
     "  -p, --progress      Show progress information.\n"
     "  -h, --help          Print this help message.\n"
     "  -f, --force         Overwrite existing files.\n"
     "  -c, --stdout        Write output to the standard output.\n"
+    "  -z, --compress      Compress the input before encoding.\n"
     "Additional options:\n"
-    "  -m, --mode=mode     Set the mode of operation (OFB/CTR).\n"
+    "  -m, --mode=mode     Set the mode of operation (OFB/CTR/CTR128).\n"
     "  -k, --key=key       Specify the key file.\n"
+    "  -t, --threads=n     Set the number of worker threads.\n"
+    "      --batch=n       Set the number of blocks per thread and batch.\n"
+    "      --kernel=name   Select the block cipher implementation.\n"
+    "      --range=off:len Decode only `len' bytes at offset `off'.\n"
+    "      --append        Append to an existing encoded output file.\n"
+    "      --sector=size   Use the length-preserving sector mode.\n"
+    "      --stripe=f1,f2  Stripe the output over several files.\n"
+    "      --incremental   Only re-encode what changed in the output file.\n"
+    "      --stream=ms[:n] Flush pending input after `ms' milliseconds or\n"
+    "                      `n' bytes, for use in pipes.\n"
     "Written by Kamila Szewczyk (k@iczelia.net).\n"
     "Released to the public domain.\n"
   );
@@ -424,22 +2110,126 @@ static uint32_t zerodev_tell(void * stream) {
   return *((uint32_t *) stream);
 }
 
+// ---------------------------------------------------------------------------
+//      Runtime profile. `kcrypt3 --tune' measures the throughput of the
+//      multi-block engine for a range of thread counts and batch sizes and
+//      stores the fastest configuration, which is then loaded on every run.
+// ---------------------------------------------------------------------------
+static const char * profile_path(char buf[4096]) {
+  const char * path = getenv("KCRYPT3_PROFILE"), * home = getenv("HOME");
+  if (path) return path;
+  if (!home) home = getenv("USERPROFILE");
+  if (!home) return NULL;
+  snprintf(buf, 4096, "%s/.kcrypt3", home);
+  return buf;
+}
+
+static void load_profile(int * threads, int * batch, char kernel[32]) {
+  char buf[4096], key[32], val[32];
+  const char * path = profile_path(buf);
+  FILE * f = path ? fopen(path, "r") : NULL;
+  if (!f) return;
+  while (fscanf(f, " %31[^=\n]=%31s", key, val) == 2) {
+    if (!strcmp(key, "threads") && atoi(val) > 0) *threads = atoi(val);
+    else if (!strcmp(key, "batch") && atoi(val) > 0) *batch = atoi(val);
+    else if (!strcmp(key, "kernel")) strcpy(kernel, val);
+  }
+  fclose(f);
+}
+
+static int cpu_count(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+#else
+  return 1;
+#endif
+}
+
+static double bench_engine(int threads, int batch) {
+  uint32_t size = 2 * 63 * batch * threads;
+  gf * zero = calloc(size, 1), in[64] = { 0 };
+  if (!zero) eprintf("Out of memory.\n");
+  block_key_t k;  secrandom(&k, sizeof(k));
+  struct timespec t0, t1;  double elapsed;  uint64_t bytes = 0;
+  timespec_get(&t0, TIME_UTC);
+  do {
+    mode_params_t params = {
+      .key = k, .threads = threads, .batch = batch,
+      .input = { .type = CIPHER_STREAM_BLOCK, .buffer = zero, .size = size },
+      .output = {
+        .type = CIPHER_STREAM_FUNCTION, .stream = { .write = zerodev_write }
+      }
+    };
+    encode_ctr_from(&params, 0, in, 0);
+    bytes += size;
+    timespec_get(&t1, TIME_UTC);
+    elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  } while (elapsed < 0.25);
+  free(zero);
+  return bytes / elapsed;
+}
+
+static void tune(void) {
+  int ncpu = cpu_count(), best_threads = 1, best_batch = ENGINE_BATCH;
+  const kernel_t * best_kernel = kernel;
+  double best = 0;
+  for (const kernel_t * k = KERNELS; k->name; k++) {
+    if (k->supported && !k->supported()) continue;
+    kernel = k;
+    double rate = bench_engine(1, ENGINE_BATCH);
+    fprintf(stderr, "kernel=%s: %.0fkB/s\n", k->name, rate / 1024);
+    if (rate > best)
+      best = rate, best_kernel = k;
+  }
+  kernel = best_kernel;  best = 0;
+  for (int t = 1; t <= ncpu; t = t < ncpu && t * 2 > ncpu ? ncpu : t * 2)
+    for (int b = 16; b <= 256; b *= 4) {
+      double rate = bench_engine(t, b);
+      fprintf(stderr, "threads=%d batch=%d: %.0fkB/s\n", t, b, rate / 1024);
+      if (rate > best)
+        best = rate, best_threads = t, best_batch = b;
+    }
+  char buf[4096];  const char * path = profile_path(buf);
+  if (!path) eprintf("Could not locate the home directory.\n");
+  FILE * f = fopen(path, "w");
+  if (!f) eprintf("Could not open `%s': %s\n", path, strerror(errno));
+  fprintf(f, "kernel=%s\nthreads=%d\nbatch=%d\n",
+    kernel->name, best_threads, best_batch);
+  if (fclose(f) != 0)
+    eprintf("Could not close `%s': %s\n", path, strerror(errno));
+  fprintf(stderr, "Wrote kernel=%s threads=%d batch=%d to `%s'.\n",
+    kernel->name, best_threads, best_batch, path);
+}
+
 int main(int argc, char * argv[]) {
-  gentab(0x1d);
+  kcrypt3_init();
   yarg_options opt[] = {
     // Actions
     { 'e', no_argument, "encode" },
     { 'd', no_argument, "decode" },
     { 'g', no_argument, "genkey" },
     { 'r', no_argument, "random" },
+    { OPT_TUNE, no_argument, "tune" },
+    { OPT_REKEY, required_argument, "rekey" },
     // General
     { 'v', no_argument, "version" },
     { 'p', no_argument, "progress" },
     { 'h', no_argument, "help" },
     { 'c', no_argument, "stdout" },
     { 'f', no_argument, "force" },
+    { 'z', no_argument, "compress" },
     { 'm', required_argument, "mode" },
     { 'k', required_argument, "key" },
+    { 't', required_argument, "threads" },
+    { OPT_BATCH, required_argument, "batch" },
+    { OPT_KERNEL, required_argument, "kernel" },
+    { OPT_RANGE, required_argument, "range" },
+    { OPT_APPEND, no_argument, "append" },
+    { OPT_SECTOR, required_argument, "sector" },
+    { OPT_STRIPE, required_argument, "stripe" },
+    { OPT_INCREMENTAL, no_argument, "incremental" },
+    { OPT_STREAM, required_argument, "stream" },
     { 0, 0, 0 }
   };
   yarg_settings settings = {
@@ -449,27 +2239,82 @@ int main(int argc, char * argv[]) {
   if (!res) eprintf("Out of memory.\n");
   if (res->error)
     eprintf("%s\nTry `kcrypt3 --help' for more information.\n", res->error);
-  int mode = -1, force = 0, progress = 0, force_stdout = 0;
-  stream_enc enc = NULL; stream_dec dec = NULL;
-  const char * key_path = NULL;
+  int mode = -1, force = 0, progress = 0, force_stdout = 0, append = 0;
+  int compress = 0, threads = 1, batch = ENGINE_BATCH, incremental = 0;
+  int stream = 0, flush_ms = 0;  size_t flush_bytes = 0;
+  size_t sector = 0;  char kernel_name[32] = "";  int kernel_forced = 0;
+  load_profile(&threads, &batch, kernel_name);
+  stream_enc enc = NULL, app = NULL; stream_dec dec = NULL;
+  const char * key_path = NULL, * new_key_path = NULL;
+  char * stripe = NULL;
+  uint64_t range_start = 0, range_end = 0;
   for (int i = 0; i < res->argc; i++) {
     switch(res->args[i].opt) {
       case 'e': mode = MODE_ENCODE; break;
       case 'd': mode = MODE_DECODE; break;
       case 'g': mode = MODE_KEYGEN; break;
       case 'r': mode = MODE_RANDOM; break;
+      case OPT_TUNE: mode = MODE_TUNE; break;
+      case OPT_REKEY:
+        mode = MODE_REKEY;  new_key_path = res->args[i].arg;
+        break;
       case 'f': force = 1; break;
       case 'h': help(); return 0;
       case 'v': version(); return 0;
       case 'p': progress = 1; break;
       case 'c': force_stdout = 1; break;
+      case 'z': compress = 1; break;
       case 'k': key_path = res->args[i].arg; break;
+      case OPT_APPEND: append = 1; break;
+      case OPT_STRIPE: stripe = res->args[i].arg; break;
+      case OPT_INCREMENTAL: incremental = 1; break;
+      case OPT_STREAM: {
+        char * end;
+        flush_ms = strtol(res->args[i].arg, &end, 10);
+        if (*end == ':') flush_bytes = strtoul(end + 1, &end, 0);
+        if (*end || flush_ms < 0)
+          eprintf("Invalid stream flushing settings `%s'.\n", res->args[i].arg);
+        stream = 1;
+        break;
+      }
+      case 't':
+        if ((threads = atoi(res->args[i].arg)) < 1)
+          eprintf("Invalid thread count `%s'.\n", res->args[i].arg);
+        break;
+      case OPT_KERNEL:
+        snprintf(kernel_name, sizeof(kernel_name), "%s", res->args[i].arg);
+        kernel_forced = 1;
+        break;
+      case OPT_SECTOR:
+        sector = strtoul(res->args[i].arg, NULL, 0);
+        if (sector == 0 || sector % 64)
+          eprintf("Invalid sector size `%s'.\n", res->args[i].arg);
+        break;
+      case OPT_BATCH:
+        if ((batch = atoi(res->args[i].arg)) < 1)
+          eprintf("Invalid batch size `%s'.\n", res->args[i].arg);
+        break;
+      case OPT_RANGE: {
+        char * p = res->args[i].arg;
+        range_start = strtoull(p, &p, 0);  range_end = UINT64_MAX;
+        if (*p == ':' && p[1]) {
+          uint64_t len = strtoull(p + 1, &p, 0);
+          if (len == 0 || len > UINT64_MAX - range_start)
+            eprintf("Invalid range `%s'.\n", res->args[i].arg);
+          range_end = range_start + len;
+        } else if (*p == ':') p++;
+        if (*p)
+          eprintf("Invalid range `%s'.\n", res->args[i].arg);
+        break;
+      }
       case 'm':
         for (char * p = res->args[i].arg; *p; p++) *p = tolower(*p);
         if (!strcmp(res->args[i].arg, "ofb"))
           enc = encode_ofb, dec = decode_ofb;
         else if (!strcmp(res->args[i].arg, "ctr"))
           enc = encode_ctr, dec = decode_ctr;
+        else if (!strcmp(res->args[i].arg, "ctr128"))
+          enc = encode_ctr128, dec = decode_ctr128;
         else
           eprintf("Unknown mode of operation `%s'.\n", res->args[i].arg);
         break;
@@ -478,6 +2323,36 @@ int main(int argc, char * argv[]) {
   if (mode == -1)
     eprintf("No action specified.\n"
             "Try `kcrypt3 --help' for more information.\n");
+  // A profile may have been tuned on another CPU: fall back to the
+  // automatic choice unless the kernel was asked for explicitly.
+  if (!kernel_select(*kernel_name ? kernel_name : NULL)) {
+    if (kernel_forced) eprintf("Kernel `%s' is not supported.\n", kernel_name);
+    kernel_select(NULL);
+  }
+  if (range_end && mode != MODE_DECODE)
+    eprintf("A range can only be specified for decryption.\n");
+  if (append && mode != MODE_ENCODE)
+    eprintf("Only encoded output can be appended to.\n");
+  if (sector && (mode != MODE_ENCODE && mode != MODE_DECODE))
+    eprintf("Sector mode can only be used for encryption and decryption.\n");
+  if (sector && (enc || compress || append || range_end || stripe))
+    eprintf("Sector mode can not be combined with other modes.\n");
+  if (compress && mode != MODE_ENCODE)
+    eprintf("Compression can only be requested for encryption.\n");
+  if (stripe && ((mode != MODE_ENCODE && mode != MODE_REKEY) || append))
+    eprintf("Only new encoded output can be striped.\n");
+  if (incremental && (mode != MODE_ENCODE || enc || compress || append
+      || sector || stripe))
+    eprintf("The incremental mode can not be combined with other modes.\n");
+  if (stream && (mode != MODE_ENCODE || enc || compress || append
+      || sector || stripe || incremental))
+    eprintf("The streaming mode can not be combined with other modes.\n");
+#ifndef HAVE_STREAM_MODE
+  if (stream)
+    eprintf("The streaming mode is not supported on this platform.\n");
+#endif
+  if (append && force_stdout)
+    eprintf("Cannot append to the standard output.\n");
   #if defined(__MSVCRT__)
     setmode(STDIN_FILENO, O_BINARY);
     setmode(STDOUT_FILENO, O_BINARY);
@@ -512,11 +2387,15 @@ int main(int argc, char * argv[]) {
             eprintf("File `%s' has an unrecognised extension.\n", f1);
         }
       } else { input = f1, output = f2; }
+    } else if (mode == MODE_REKEY) {
+      input = f1, output = f2;
+      if (f2 == NULL && !force_stdout)
+        eprintf("No output file specified. Use `-c' to write to stdout.\n");
     } else if (mode == MODE_RANDOM) {
       output = f1;
       if (f2 != NULL)
         eprintf("Too many positional arguments.\n");
-    } else if (mode == MODE_KEYGEN) {
+    } else if (mode == MODE_KEYGEN || mode == MODE_TUNE) {
       if (f1 != NULL || f2 != NULL)
         eprintf("Too many positional arguments.\n");
     }
@@ -532,14 +2411,30 @@ int main(int argc, char * argv[]) {
     if (!key_file)
       eprintf("Could not open `%s': %s\n", key_path, strerror(errno));
   }
-  if (output && !force && access(output, F_OK) == 0)
+  if (append && output == NULL)
+    eprintf("No output file to append to.\n");
+  if (output && !force && !append && !incremental
+      && access(output, F_OK) == 0)
     eprintf("File `%s' already exists. Use `-f' to overwrite.\n", output);
+  if (stripe && !force) stripe_check(stripe, output);
+  // The incremental mode writes a new file next to the previous output,
+  // which replaces it once complete.
+  char * out_path = output;  FILE * previous = NULL;
+  if (incremental && output != NULL) {
+    if (!(out_path = malloc(strlen(output) + 5)))
+      eprintf("Out of memory.\n");
+    sprintf(out_path, "%s.tmp", output);
+    previous = fopen(output, "rb");
+  }
   if (output != NULL) {
-    out_file = fopen(output, "wb");
+    out_file = fopen(out_path, append ? "r+b" : "wb");
     if (!out_file)
-      eprintf("Could not open `%s': %s\n", output, strerror(errno));
+      eprintf("Could not open `%s': %s\n", out_path, strerror(errno));
   }
   switch(mode) {
+    case MODE_TUNE:
+      tune();
+      break;
     case MODE_KEYGEN: {
       if (!key_file) eprintf("No key file specified.\n");
       block_key_t k; secrandom(&k, sizeof(k));
@@ -563,13 +2458,31 @@ int main(int argc, char * argv[]) {
         .pcb = progress ? progress_callback : NULL,
         .key = k, .input = zero_device, .output = {
           .type = CIPHER_STREAM_FILE, .file = out_file
-        }
+        }, .threads = threads, .batch = batch
       };
       enc(&params);
       break;
     }
     case MODE_ENCODE: {
       if (!key_file) eprintf("No key file specified.\n");
+      if (append && (enc || dec || compress))
+        eprintf("Mode of operation needs not specified for appending.\n");
+      if (append) {
+        cipher_aux_t existing = { .type = CIPHER_STREAM_FILE, .file = out_file };
+        compress = detect_mode_of_operation(&existing, output, &enc, &dec, &app);
+        if (existing.type != CIPHER_STREAM_FILE)
+          eprintf("Striped output can not be appended to.\n");
+        if (!app)
+          eprintf("This mode of operation can not be appended to.\n");
+      }
+      if (incremental)
+        enc = encode_inc, dec = decode_inc;
+      if (sector)
+        enc = encode_sectors, dec = decode_sectors;
+#ifdef HAVE_STREAM_MODE
+      if (stream)
+        enc = encode_stream, dec = decode_stream;
+#endif
       if (!enc || !dec)
         eprintf("No mode of operation specified.\n");
       block_key_t k;
@@ -581,14 +2494,29 @@ int main(int argc, char * argv[]) {
       cipher_aux_t output = {
         .type = CIPHER_STREAM_FILE, .file = out_file
       };
+      if (stripe)
+        output = stripe_create(stripe, out_file, out_path);
+      lz_stream_t * lz = NULL;
+      if (compress) {
+        lz = lz_open(in_file);
+        input = (cipher_aux_t) {
+          .type = CIPHER_STREAM_FUNCTION, .max = input.max,
+          .stream = { lz_read, NULL, lz_tell, lz }
+        };
+      }
       mode_params_t params = {
         .pcb = progress ? progress_callback : NULL,
-        .key = k, .input = input, .output = output
+        .key = k, .input = input, .output = output, .compress = compress,
+        .threads = threads, .batch = batch, .sector = sector,
+        .previous = previous, .flush_ms = flush_ms, .flush_bytes = flush_bytes
       };
-      enc(&params);
+      (append ? app : enc)(&params);
+      if (lz) lz_close(lz);
+      if (stripe) stripe_close(params.output.stream.stream);
       break;
     }
     case MODE_DECODE: {
+      const char * in_path = input; // Shadowed below.
       if (!key_file) eprintf("No key file specified.\n");
       if (enc || dec)
         eprintf("Mode of operation needs not specified for decryption.\n");
@@ -601,17 +2529,71 @@ int main(int argc, char * argv[]) {
       cipher_aux_t output = {
         .type = CIPHER_STREAM_FILE, .file = out_file
       };
+      lz_stream_t * lz = NULL;
+      if (sector)
+        dec = decode_sectors;
+      else if (detect_mode_of_operation(&input, in_path, &enc, &dec, &app)) {
+        if (range_end)
+          eprintf("Ranges are not supported for compressed input.\n");
+        lz = lz_open(out_file);
+        output = (cipher_aux_t) {
+          .type = CIPHER_STREAM_FUNCTION,
+          .stream = { NULL, lz_write, lz_tell, lz }
+        };
+      }
       mode_params_t params = {
         .pcb = progress ? progress_callback : NULL,
-        .key = k, .input = input, .output = output
+        .key = k, .input = input, .output = output,
+        .range_start = range_start, .range_end = range_end,
+        .threads = threads, .batch = batch, .sector = sector
       };
-      detect_mode_of_operation(in_file, &enc, &dec);
       dec(&params);
+      if (lz) lz_close(lz);
+      if (params.input.type == CIPHER_STREAM_FUNCTION)
+        stripe_close(params.input.stream.stream);
+      break;
+    }
+    case MODE_REKEY: {
+      if (!key_file) eprintf("No key file specified.\n");
+      block_key_t k, new_k;
+      if (fread(&k, sizeof(k), 1, key_file) != 1)
+        eprintf("Truncated input.\n");
+      FILE * new_key_file = fopen(new_key_path, "rb");
+      if (!new_key_file)
+        eprintf("Could not open `%s': %s\n", new_key_path, strerror(errno));
+      if (fread(&new_k, sizeof(new_k), 1, new_key_file) != 1)
+        eprintf("Truncated input.\n");
+      fclose(new_key_file);
+      mode_params_t from = {
+        .pcb = progress ? progress_callback : NULL, .key = k,
+        .input = {
+          .type = CIPHER_STREAM_FILE, .file = in_file,
+          .max = file_size(in_file)
+        }, .threads = threads, .batch = batch
+      };
+      stream_enc old_enc;  stream_dec old_dec;
+      int z = detect_mode_of_operation(&from.input, input, &old_enc, &old_dec, &app);
+      mode_params_t to = {
+        .key = new_k, .output = {
+          .type = CIPHER_STREAM_FILE, .file = out_file
+        }, .compress = z, .threads = threads, .batch = batch
+      };
+      if (stripe)
+        to.output = stripe_create(stripe, out_file, output);
+      rekey(old_dec, &from, enc ? enc : old_enc, &to);
+      if (from.input.type == CIPHER_STREAM_FUNCTION)
+        stripe_close(from.input.stream.stream);
+      if (stripe) stripe_close(to.output.stream.stream);
       break;
     }
   }
   if (input != NULL && fclose(in_file) != 0)
     eprintf("Could not close `%s': %s\n", input, strerror(errno));
   if (output != NULL && fclose(out_file) != 0)
-    eprintf("Could not close `%s': %s\n", output, strerror(errno));
+    eprintf("Could not close `%s': %s\n", out_path, strerror(errno));
+  if (previous != NULL)
+    fclose(previous);
+  if (out_path != output && rename(out_path, output) != 0)
+    eprintf("Could not rename `%s': %s\n", out_path, strerror(errno));
 }
+#endif
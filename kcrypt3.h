@@ -0,0 +1,52 @@
+// ---------------------------------------------------------------------------
+//      KCrypt3 - 3rd iteration of the KCrypt algorithm.
+//      Library interface, see README.md for the description of the cipher.
+// ---------------------------------------------------------------------------
+#ifndef _KCRYPT3_H
+#define _KCRYPT3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The key: the combining state and the permuting state.
+typedef struct { uint8_t k1[32]; uint8_t k2[64]; } block_key_t;
+
+// Builds the tables and selects the fastest kernel. Called by every
+// function below, so it needs not be called explicitly.
+void kcrypt3_init(void);
+
+// Records: short messages encoded into self-contained KC3CTR streams.
+// `rec[i]' must hold `record_size(len[i])' bytes. The records are spread
+// over `threads' threads.
+enum { KCRYPT3_OK, KCRYPT3_EFORMAT, KCRYPT3_ECORRUPT };
+uint32_t record_size(uint32_t len);
+void encode_records(block_key_t * key, size_t n, uint8_t ** msg,
+    uint32_t * len, uint8_t ** rec, int threads);
+// Each `out[i]' must hold at least `rec_len[i] - 10' bytes. Stores the
+// lengths of the decoded messages in `len' and the outcome of every record
+// (KCRYPT3_EFORMAT if it is not a record, KCRYPT3_ECORRUPT on a wrong key
+// or damaged data) in `err'. Returns the number of failed records.
+size_t decode_records(block_key_t * key, size_t n, uint8_t ** rec,
+    uint32_t * rec_len, uint8_t ** out, uint32_t * len, int * err,
+    int threads);
+
+// Sector mode: length-preserving, `size' must be a multiple of 64.
+void encode_sector(block_key_t * key, uint64_t sector, uint8_t * buf,
+    size_t size);
+void decode_sector(block_key_t * key, uint64_t sector, uint8_t * buf,
+    size_t size);
+
+// Multi-key interface: blocks of many independent streams in one call.
+// `n' blocks of 64 bytes at `blk' are transformed in place and the key
+// state and IV are advanced past them. Requests may share a key state, in
+// which case they are processed one after the other, in the order given.
+typedef struct {
+  block_key_t * key;
+  uint32_t IV;
+  uint8_t * blk;
+  size_t n;
+} multi_req_t;
+void encode_multi(multi_req_t * req, size_t n, int threads);
+void decode_multi(multi_req_t * req, size_t n, int threads);
+
+#endif